@@ -0,0 +1,663 @@
+/*
+*    adsim - an AD2USB panel simulator for load testing xplademco
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    adsim opens a pseudo-terminal and talks to it the way an ad2usb attached to an ademco panel would.
+*    Point xplademco's com-port at the slave side (or at the symlink given with -l).
+*
+*/
+
+/* Define these if not defined */
+
+#ifndef VERSION
+	#define VERSION "X.X.X"
+#endif
+
+#define _GNU_SOURCE
+
+#include "types.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include "notify.h"
+
+#define SHORT_OPTIONS "b:B:c:d:e:f:hk:l:L:r:t:vx:"
+
+#define OUT_SIZE 65536
+#define EXP_CHANNELS 8
+#define RFX_SENSORS 8
+#define REL_CHANNELS 4
+#define FIRST_EXP_ZONE 9
+#define FIRST_RFX_ZONE 17
+#define MAX_ZONES 99
+#define MAX_RATE 1000000	/* one message per microsecond, the scheduling resolution */
+
+/* Keypad states */
+enum { KS_DISARMED, KS_ARMED_AWAY, KS_ARMED_STAY };
+
+/* Message generators */
+enum { GEN_KEYPAD, GEN_EXP, GEN_LRR, GEN_RFX, GEN_REL, GEN_COUNT };
+
+typedef struct generator generator_t;
+
+struct generator {
+	const String name;
+	double rate;		/* Messages per second, 0 is off */
+	uint64_t next;		/* Monotonic time in us when the next one is due */
+	unsigned long sent;
+};
+
+char *progName;
+int debugLvl = 0;
+
+static int master = -1;
+static int slave = -1;
+static int keypadState = KS_DISARMED;
+static Bool acFail = FALSE;
+static unsigned expAddr = 7;
+static unsigned blipInterval = 0;
+static unsigned blipLength = 2;
+static unsigned duration = 0;
+static unsigned faultRotor = 0;
+static unsigned long dropped = 0;
+static unsigned long commands = 0;
+static unsigned outLen = 0;
+static char code[8] = "1234";
+static char keys[8];
+static char linkPath[256] = "";
+static char slaveName[256] = "";
+static char out[OUT_SIZE];
+static unsigned char faulted[MAX_ZONES + 1];
+static unsigned char relays[REL_CHANNELS];
+
+static generator_t generators[GEN_COUNT] = {
+	{"keypad", 1.0, 0, 0},
+	{"exp", 0.2, 0, 0},
+	{"lrr", 0.01, 0, 0},
+	{"rfx", 0.1, 0, 0},
+	{"rel", 0.05, 0, 0}
+};
+
+static const String lrrEvents[] = {
+	"ACLOSS",
+	"AC_RESTORE",
+	"LOWBAT",
+	"LOWBAT_RESTORE",
+	NULL
+};
+
+/* Commandline options. */
+
+static struct option longOptions[] = {
+	{"blip-interval", 1, 0, 'b'},
+	{"blip-length", 1, 0, 'B'},
+	{"code", 1, 0, 'c'},
+	{"debug-level", 1, 0, 'd'},
+	{"exp-rate", 1, 0, 'e'},
+	{"help", 0, 0, 'h'},
+	{"keypad-rate", 1, 0, 'k'},
+	{"link", 1, 0, 'l'},
+	{"lrr-rate", 1, 0, 'L'},
+	{"rel-rate", 1, 0, 'r'},
+	{"rfx-rate", 1, 0, 'f'},
+	{"time", 1, 0, 't'},
+	{"version", 0, 0, 'v'},
+	{"exp-address", 1, 0, 'x'},
+	{0, 0, 0, 0}
+};
+
+
+/*
+* Return the monotonic clock in microseconds
+*/
+
+static uint64_t nowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/*
+* Write out what the panel side will take.
+* Anything left over stays queued, and is sent on the next call.
+*/
+
+static void flushOut(void)
+{
+	int res;
+
+	if(!outLen)
+		return;
+	if(master < 0){
+		dropped += outLen;
+		outLen = 0;
+		return;
+	}
+	res = write(master, out, outLen);
+	if(res < 0){
+		if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return; /* Try again later */
+		debug(DEBUG_UNEXPECTED, "Write error on pty: %s", strerror(errno));
+		dropped += outLen;
+		outLen = 0;
+		return;
+	}
+	outLen -= res;
+	if(outLen)
+		memmove(out, out + res, outLen);
+}
+
+/*
+* Queue a line for the panel side, terminated the way the ad2usb does it
+*/
+
+static void emit(const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if(outLen > OUT_SIZE - 256)
+		flushOut();
+
+	va_start(ap, fmt);
+	if(outLen > OUT_SIZE - 256){
+		/* The panel side isn't keeping up, drop the whole line */
+		len = vsnprintf(NULL, 0, fmt, ap);
+		va_end(ap);
+		dropped += len + 2;
+		return;
+	}
+	len = vsnprintf(out + outLen, OUT_SIZE - outLen - 2, fmt, ap);
+	va_end(ap);
+
+	debug(DEBUG_ACTION, "Sending: %s", out + outLen);
+	outLen += len;
+	out[outLen++] = '\r';
+	out[outLen++] = '\n';
+}
+
+/*
+* Return the lowest numbered faulted zone after the one shown last, so the display rotates the way a keypad does.
+* Return 0 if nothing is faulted.
+*/
+
+static unsigned nextFault(void)
+{
+	unsigned i, z;
+
+	for(i = 1; i <= MAX_ZONES; i++){
+		z = ((faultRotor + i - 1) % MAX_ZONES) + 1;
+		if(faulted[z]){
+			faultRotor = z;
+			return z;
+		}
+	}
+	return 0;
+}
+
+/*
+* Send a keypad message reflecting the current state
+*/
+
+static void emitKeypad(void)
+{
+	char bits[21];
+	char alpha[33];
+	unsigned zone = 0;
+
+	memset(bits, '0', 20);
+	memcpy(bits + 16, "----", 4);
+	bits[20] = 0;
+
+	bits[3] = '1'; /* Back light */
+	bits[7] = acFail ? '0' : '1'; /* AC power */
+
+	switch(keypadState){
+		case KS_ARMED_AWAY:
+			bits[1] = '1';
+			snprintf(alpha, sizeof(alpha), "%-32s", "ARMED ***AWAY***You may exit now");
+			break;
+
+		case KS_ARMED_STAY:
+			bits[2] = '1';
+			bits[15] = '1';
+			snprintf(alpha, sizeof(alpha), "%-32s", "ARMED ***STAY***                ");
+			break;
+
+		default:
+			if((zone = nextFault())){
+				snprintf(alpha, sizeof(alpha), "FAULT %02u ZONE %02u%16s", zone, zone, "");
+			}
+			else{
+				bits[0] = '1'; /* Ready */
+				snprintf(alpha, sizeof(alpha), "%-32s", "****DISARMED****  Ready to Arm  ");
+			}
+			break;
+	}
+
+	emit("[%s],%03u,[f70000051%03u001c08020000000000],\"%s\"", bits, zone ? zone : 8, zone ? zone : 8, alpha);
+}
+
+/*
+* Toggle a random expander channel
+*/
+
+static void emitExp(void)
+{
+	unsigned channel = (random() % EXP_CHANNELS) + 1;
+	unsigned zone = FIRST_EXP_ZONE + channel - 1;
+
+	faulted[zone] = !faulted[zone];
+	emit("!EXP:%02u,%02u,%02u", expAddr, channel, faulted[zone]);
+}
+
+/*
+* Send a random long range radio event
+*/
+
+static void emitLrr(void)
+{
+	unsigned i, n;
+
+	for(n = 0; lrrEvents[n]; n++);
+	i = random() % n;
+	if(!strcmp(lrrEvents[i], "ACLOSS"))
+		acFail = TRUE;
+	else if(!strcmp(lrrEvents[i], "AC_RESTORE"))
+		acFail = FALSE;
+	emit("!LRR:000,1,%s", lrrEvents[i]);
+}
+
+/*
+* Send a random wireless sensor report
+*/
+
+static void emitRfx(void)
+{
+	unsigned sensor = random() % RFX_SENSORS;
+	unsigned zone = FIRST_RFX_ZONE + sensor;
+	unsigned status;
+
+	faulted[zone] = !faulted[zone];
+	status = faulted[zone] ? 0x80 : 0x00; /* Loop 1 */
+	if(!(random() % 20))
+		status |= 0x02; /* Low battery */
+	if(!(random() % 50))
+		status |= 0x04; /* Supervision */
+	emit("!RFX:%07u,%02x", 123450 + sensor, status);
+}
+
+/*
+* Toggle a random relay
+*/
+
+static void emitRel(void)
+{
+	unsigned channel = random() % REL_CHANNELS;
+
+	relays[channel] = !relays[channel];
+	emit("!REL:12,%02u,%02u", channel + 1, relays[channel]);
+}
+
+/*
+* Act on a keystroke from xplademco. A valid code followed by 1 disarms, 2 arms away, 3 arms stay.
+*/
+
+static void keypadInput(char c)
+{
+	size_t codeLen = strlen(code);
+	size_t len = strlen(keys);
+
+	if((c < '0') || (c > '9')){ /* Anything else clears the entry */
+		keys[0] = 0;
+		return;
+	}
+	if(len == codeLen){
+		if(c >= '1' && c <= '3'){
+			commands++;
+			if(!strcmp(keys, code)){
+				switch(c){
+					case '1':
+						keypadState = KS_DISARMED;
+						emit("!LRR:001,1,OPEN");
+						break;
+					case '2':
+						keypadState = KS_ARMED_AWAY;
+						emit("!LRR:001,1,ARM_AWAY");
+						break;
+					default:
+						keypadState = KS_ARMED_STAY;
+						emit("!LRR:001,1,ARM_STAY");
+						break;
+				}
+				debug(DEBUG_EXPECTED, "Keypad command %c accepted", c);
+				emitKeypad(); /* Acknowledge with the new status bits */
+			}
+			else
+				debug(DEBUG_EXPECTED, "Keypad command %c with bad code %s", c, keys);
+		}
+		keys[0] = 0;
+		return;
+	}
+	keys[len] = c;
+	keys[len + 1] = 0;
+}
+
+/*
+* Open a new pty, and point the link at it
+*/
+
+static void ptyOpen(void)
+{
+	struct termios termios;
+	char *name;
+
+	if((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0)
+		fatal_with_reason(errno, "posix_openpt");
+	if(grantpt(master) || unlockpt(master))
+		fatal_with_reason(errno, "grantpt/unlockpt");
+	if(!(name = ptsname(master)))
+		fatal_with_reason(errno, "ptsname");
+	snprintf(slaveName, sizeof(slaveName), "%s", name);
+
+	/* Hold the slave open in raw mode so there is no echo, and no hangup when xplademco lets go */
+	if((slave = open(slaveName, O_RDWR | O_NOCTTY)) < 0)
+		fatal_with_reason(errno, "open %s", slaveName);
+	if(tcgetattr(slave, &termios) == 0){
+		cfmakeraw(&termios);
+		tcsetattr(slave, TCSANOW, &termios);
+	}
+	if(fcntl(master, F_SETFL, O_NONBLOCK) == -1)
+		fatal_with_reason(errno, "fcntl");
+
+	if(linkPath[0]){
+		unlink(linkPath);
+		if(symlink(slaveName, linkPath))
+			fatal_with_reason(errno, "symlink %s", linkPath);
+	}
+	keys[0] = 0;
+	debug(DEBUG_STATUS, "Panel is on %s", slaveName);
+}
+
+/*
+* Make the adapter disappear, the way a USB blip would
+*/
+
+static void ptyClose(void)
+{
+	if(linkPath[0])
+		unlink(linkPath);
+	if(slave >= 0)
+		close(slave);
+	if(master >= 0)
+		close(master);
+	master = slave = -1;
+	outLen = 0;
+	debug(DEBUG_STATUS, "Panel disconnected");
+}
+
+/*
+* Clean up on the way out
+*/
+
+static void shutdownHandler(int onSignal)
+{
+	if(linkPath[0])
+		unlink(linkPath);
+	exit(0);
+}
+
+/*
+* Show help
+*/
+
+static void showHelp(void)
+{
+	printf("'%s' simulates an ademco panel with an ad2usb adapter on a pseudo-terminal\n", progName);
+	printf("\n");
+	printf("Usage: %s [OPTION]...\n", progName);
+	printf("\n");
+	printf("Rates are in messages per second up to %d, 0 turns a message type off.\n", MAX_RATE);
+	printf("\n");
+	printf("  -b, --blip-interval SEC Disconnect the adapter every SEC seconds, default is never\n");
+	printf("  -B, --blip-length SEC   Stay disconnected for SEC seconds, default is %u\n", blipLength);
+	printf("  -c, --code CODE         Keypad code accepted for arm/disarm, default is %s\n", code);
+	printf("  -d, --debug-level LEVEL Set the debug level, 0 is off, the max is %d\n", DEBUG_MAX);
+	printf("  -e, --exp-rate RATE     !EXP rate, default is %g\n", generators[GEN_EXP].rate);
+	printf("  -f, --rfx-rate RATE     !RFX rate, default is %g\n", generators[GEN_RFX].rate);
+	printf("  -h, --help              Shows this\n");
+	printf("  -k, --keypad-rate RATE  Keypad status message rate, default is %g\n", generators[GEN_KEYPAD].rate);
+	printf("  -l, --link PATH         Symlink PATH to the slave side of the pty\n");
+	printf("  -L, --lrr-rate RATE     Random !LRR rate, default is %g\n", generators[GEN_LRR].rate);
+	printf("  -r, --rel-rate RATE     !REL rate, default is %g\n", generators[GEN_REL].rate);
+	printf("  -t, --time SEC          Run for SEC seconds then print the counts, default is forever\n");
+	printf("  -v, --version           Display program version\n");
+	printf("  -x, --exp-address ADDR  Expander address, default is %u\n", expAddr);
+	printf("\n");
+	return;
+}
+
+/*
+* Parse a rate, it must be between 0 and MAX_RATE
+*/
+
+static double getRate(const char *arg)
+{
+	double rate = atof(arg);
+
+	if(!((rate >= 0) && (rate <= MAX_RATE)))
+		fatal("Invalid rate: %s, the maximum is %d", arg, MAX_RATE);
+	return rate;
+}
+
+
+/*
+* main
+*/
+
+int main(int argc, char *argv[])
+{
+	int longindex, optchar, i, res;
+	uint64_t now, next, start, blipAt = 0, reconnectAt = 0;
+	struct pollfd pfd;
+	char buf[256];
+	int timeout;
+
+	/* Set the program name */
+	progName = argv[0];
+
+	/* Parse the arguments. */
+	while((optchar = getopt_long(argc, argv, SHORT_OPTIONS, longOptions, &longindex)) != EOF) {
+		switch(optchar) {
+			case '?':
+				exit(1);
+
+			case 'b':
+				blipInterval = atoi(optarg);
+				break;
+
+			case 'B':
+				blipLength = atoi(optarg);
+				break;
+
+			case 'c':
+				if((strlen(optarg) < 1) || (strlen(optarg) > 6))
+					fatal("Invalid code");
+				snprintf(code, sizeof(code), "%s", optarg);
+				break;
+
+			case 'd':
+				debugLvl = atoi(optarg);
+				if(debugLvl < 0 || debugLvl > DEBUG_MAX)
+					fatal("Invalid debug level");
+				break;
+
+			case 'e':
+				generators[GEN_EXP].rate = getRate(optarg);
+				break;
+
+			case 'f':
+				generators[GEN_RFX].rate = getRate(optarg);
+				break;
+
+			case 'h':
+				showHelp();
+				exit(0);
+
+			case 'k':
+				generators[GEN_KEYPAD].rate = getRate(optarg);
+				break;
+
+			case 'l':
+				snprintf(linkPath, sizeof(linkPath), "%s", optarg);
+				break;
+
+			case 'L':
+				generators[GEN_LRR].rate = getRate(optarg);
+				break;
+
+			case 'r':
+				generators[GEN_REL].rate = getRate(optarg);
+				break;
+
+			case 't':
+				duration = atoi(optarg);
+				break;
+
+			case 'v':
+				printf("Version: %s\n", VERSION);
+				exit(0);
+
+			case 'x':
+				expAddr = atoi(optarg);
+				if((expAddr < 1) || (expAddr > 99))
+					fatal("Expander address is limited from 1 - 99");
+				break;
+
+			default:
+				fatal("Unhandled getopt return value %d", optchar);
+		}
+	}
+
+	if(optind < argc)
+		fatal("Extra argument on commandline, '%s'", argv[optind]);
+
+	signal(SIGTERM, shutdownHandler);
+	signal(SIGINT, shutdownHandler);
+	srandom(time(NULL));
+
+	ptyOpen();
+	if(!linkPath[0])
+		printf("%s\n", slaveName);
+	fflush(stdout);
+
+	start = now = nowUs();
+	for(i = 0; i < GEN_COUNT; i++)
+		generators[i].next = now;
+	if(blipInterval)
+		blipAt = now + (uint64_t) blipInterval * 1000000;
+
+	for(;;){
+		now = nowUs();
+
+		if(duration && (now - start >= (uint64_t) duration * 1000000))
+			break;
+
+		/* Simulated USB blips */
+		if(blipAt && (now >= blipAt)){
+			ptyClose();
+			blipAt = 0;
+			reconnectAt = now + (uint64_t) blipLength * 1000000;
+		}
+		if(reconnectAt && (now >= reconnectAt)){
+			ptyOpen();
+			reconnectAt = 0;
+			blipAt = now + (uint64_t) blipInterval * 1000000;
+		}
+
+		/* Generate everything which is due */
+		next = now + 1000000;
+		for(i = 0; i < GEN_COUNT; i++){
+			generator_t *g = &generators[i];
+			if(g->rate <= 0)
+				continue;
+			while(g->next <= now){
+				if(master >= 0){
+					switch(i){
+						case GEN_KEYPAD:
+							emitKeypad();
+							break;
+						case GEN_EXP:
+							emitExp();
+							break;
+						case GEN_LRR:
+							emitLrr();
+							break;
+						case GEN_RFX:
+							emitRfx();
+							break;
+						default:
+							emitRel();
+							break;
+					}
+					g->sent++;
+				}
+				g->next += (uint64_t) (1000000 / g->rate);
+			}
+			if(g->next < next)
+				next = g->next;
+		}
+		flushOut();
+
+		/* Wait for keystrokes, or until the next message is due */
+		now = nowUs();
+		timeout = (next > now) ? (int) ((next - now + 999) / 1000) : 0;
+		if(master < 0){
+			usleep(timeout * 1000);
+			continue;
+		}
+		pfd.fd = master;
+		pfd.events = outLen ? POLLIN | POLLOUT : POLLIN;
+		pfd.revents = 0;
+		if(poll(&pfd, 1, timeout) > 0){
+			if((pfd.revents & POLLIN) && ((res = read(master, buf, sizeof(buf))) > 0)){
+				for(i = 0; i < res; i++)
+					keypadInput(buf[i]);
+			}
+			flushOut();
+		}
+	}
+
+	now = nowUs();
+	printf("Ran for %.1f seconds\n", (now - start) / 1e6);
+	for(i = 0; i < GEN_COUNT; i++)
+		printf("%s: %lu sent\n", generators[i].name, generators[i].sent);
+	printf("Keypad commands: %lu, bytes dropped: %lu\n", commands, dropped);
+	shutdownHandler(0);
+	return 0;
+}
@@ -0,0 +1,93 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* allocheck.c
+*
+* Count the heap allocations made after startup. Only compiled in with make ALLOC_CHECK=1,
+* which links with --wrap for each allocator so the calls land here first.
+*
+*/
+
+#ifdef ALLOC_CHECK
+
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "allocheck.h"
+
+static int armed = 0;
+static unsigned long count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size)
+{
+	count += armed;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	count += armed;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	count += armed;
+	return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+	count += armed;
+	return __real_strdup(s);
+}
+
+/*
+* Start counting. Called once startup is done.
+*/
+
+void allocheck_arm(void)
+{
+	armed = 1;
+	debug(DEBUG_STATUS, "Allocation checking armed");
+}
+
+/*
+* Return the number of allocations since the checker was armed
+*/
+
+unsigned long allocheck_count(void)
+{
+	return count;
+}
+
+/*
+* Fail if anything was allocated since the count was taken
+*/
+
+void allocheck_verify(unsigned long before, const char *where)
+{
+	if(count != before)
+		fatal("%lu heap allocation(s) while processing %s", count - before, where);
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+*    Heap allocation checker
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    allocation checker definitions.
+*
+*    Built with make ALLOC_CHECK=1, the linker routes every malloc(), calloc(), realloc() and strdup()
+*    made by this program's objects through the wrappers in allocheck.c, which count them once the
+*    checker is armed. In a normal build the macros below compile to nothing.
+*
+*/
+
+#ifndef ALLOCHECK_H
+#define ALLOCHECK_H
+
+#ifdef ALLOC_CHECK
+
+/* Prototypes. */
+void allocheck_arm(void);
+unsigned long allocheck_count(void);
+void allocheck_verify(unsigned long before, const char *where);
+
+/* Fail if anything was allocated since ALLOCHECK_BEGIN */
+#define ALLOCHECK_BEGIN unsigned long allocBefore = allocheck_count()
+#define ALLOCHECK_END(where) allocheck_verify(allocBefore, where)
+#define ALLOCHECK_ARM() allocheck_arm()
+
+#else
+
+#define ALLOCHECK_BEGIN
+#define ALLOCHECK_END(where)
+#define ALLOCHECK_ARM()
+
+#endif
+
+#endif
@@ -0,0 +1,199 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* capture.c
+*
+* Timestamped serial capture files for recording and replaying ad2usb traffic
+*
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "types.h"
+#include "capture.h"
+#include "notify.h"
+
+#define CAPTURE_MAGIC	0x5A3C19E4
+
+/*
+* Private function to free a capture_t type
+*/
+
+static void free_capture(capturePtr_t cap)
+{
+	if(cap && (cap->magic == CAPTURE_MAGIC)){
+		if(cap->file)
+			fclose(cap->file);
+		cap->magic = 0;
+		free(cap);
+	}
+}
+
+/*
+* Private function to allocate a capture_t type and open the file
+*/
+
+static capturePtr_t new_capture(const char *path, Bool writing)
+{
+	capturePtr_t cap;
+
+	if(!(cap = malloc(sizeof(capture_t))))
+		return NULL;
+	memset(cap, 0, sizeof(capture_t));
+	cap->magic = CAPTURE_MAGIC;
+	cap->writing = writing;
+
+	if(!(cap->file = fopen(path, writing ? "w" : "r"))){
+		debug(DEBUG_UNEXPECTED, "Can't open capture file %s: %s", path, strerror(errno));
+		free_capture(cap);
+		return NULL;
+	}
+	return cap;
+}
+
+/*
+* Return the monotonic clock in microseconds
+*/
+
+uint64_t capture_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+/*
+* Open a capture file for writing, and write the signature
+*/
+
+capturePtr_t capture_open_write(const char *path)
+{
+	capturePtr_t cap;
+
+	if(!(cap = new_capture(path, TRUE)))
+		return NULL;
+
+	if(fwrite(CAPTURE_SIGNATURE, 8, 1, cap->file) != 1){
+		debug(DEBUG_UNEXPECTED, "Can't write capture file signature to %s", path);
+		free_capture(cap);
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &cap->last);
+	return cap;
+}
+
+/*
+* Open a capture file for reading, and check the signature
+*/
+
+capturePtr_t capture_open_read(const char *path)
+{
+	capturePtr_t cap;
+	char sig[8];
+
+	if(!(cap = new_capture(path, FALSE)))
+		return NULL;
+
+	if((fread(sig, 8, 1, cap->file) != 1) || memcmp(sig, CAPTURE_SIGNATURE, 8)){
+		debug(DEBUG_UNEXPECTED, "%s is not a capture file", path);
+		free_capture(cap);
+		return NULL;
+	}
+	return cap;
+}
+
+/*
+* Close a capture file
+*/
+
+void capture_close(capturePtr_t cap)
+{
+	free_capture(cap);
+}
+
+/*
+* Write a record with the bytes from one read
+*/
+
+Bool capture_write(capturePtr_t cap, const void *buffer, unsigned count)
+{
+	struct timespec now;
+	uint64_t delta;
+	uint8_t hdr[6];
+
+	if((!cap) || (cap->magic != CAPTURE_MAGIC) || (!cap->writing) || (count > CAPTURE_MAX_RECORD))
+		return FALSE;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	delta = ((uint64_t) (now.tv_sec - cap->last.tv_sec) * 1000000) + ((now.tv_nsec - cap->last.tv_nsec) / 1000);
+	if(delta > UINT32_MAX)
+		delta = UINT32_MAX;
+	cap->last = now;
+
+	hdr[0] = delta & 0xFF;
+	hdr[1] = (delta >> 8) & 0xFF;
+	hdr[2] = (delta >> 16) & 0xFF;
+	hdr[3] = (delta >> 24) & 0xFF;
+	hdr[4] = count & 0xFF;
+	hdr[5] = (count >> 8) & 0xFF;
+
+	if((fwrite(hdr, sizeof(hdr), 1, cap->file) != 1) || (fwrite(buffer, count, 1, cap->file) != 1)){
+		debug(DEBUG_UNEXPECTED, "Capture file write failed: %s", strerror(errno));
+		return FALSE;
+	}
+	/* Keep the file current in case we get killed */
+	fflush(cap->file);
+	return TRUE;
+}
+
+/*
+* Read the next record
+* Return the byte count, 0 at the end of the file, or -1 on error.
+*/
+
+int capture_read(capturePtr_t cap, uint32_t *delta_us, void *buffer, unsigned size)
+{
+	uint8_t hdr[6];
+	unsigned count;
+
+	if((!cap) || (cap->magic != CAPTURE_MAGIC) || cap->writing)
+		return -1;
+
+	if(fread(hdr, sizeof(hdr), 1, cap->file) != 1)
+		return feof(cap->file) ? 0 : -1;
+
+	count = hdr[4] | (hdr[5] << 8);
+	if(delta_us)
+		*delta_us = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | ((uint32_t) hdr[3] << 24);
+
+	if(count > size){
+		debug(DEBUG_UNEXPECTED, "Capture record of %u bytes is too large", count);
+		return -1;
+	}
+	if(count && (fread(buffer, count, 1, cap->file) != 1)){
+		debug(DEBUG_UNEXPECTED, "Truncated capture record");
+		return -1;
+	}
+	return count;
+}
@@ -0,0 +1,57 @@
+/*
+*    Serial capture file functions
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    capture file definitions.
+*
+*    A capture file starts with the 8 byte signature below. Each record which follows holds
+*    a 32 bit little endian count of microseconds since the previous record (or since the file was opened),
+*    a 16 bit little endian byte count, and the bytes returned by one read() on the serial port.
+*
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <time.h>
+#include "types.h"
+
+#define CAPTURE_SIGNATURE "XADCAP1\n"
+#define CAPTURE_MAX_RECORD 65535
+
+/* Typedefs. */
+typedef struct capture capture_t;
+typedef capture_t * capturePtr_t;
+
+/* Structure to hold capture file info. */
+struct capture {
+	unsigned magic;		/* magic number */
+	Bool writing;		/* TRUE if opened for capture, FALSE if opened for replay */
+	FILE *file;			/* capture file */
+	struct timespec last;	/* monotonic time of the last record written */
+};
+
+/* Prototypes. */
+capturePtr_t capture_open_write(const char *path);
+capturePtr_t capture_open_read(const char *path);
+void capture_close(capturePtr_t cap);
+Bool capture_write(capturePtr_t cap, const void *buffer, unsigned count);
+int capture_read(capturePtr_t cap, uint32_t *delta_us, void *buffer, unsigned size);
+uint64_t capture_now_us(void);
+
+#endif
@@ -90,6 +90,7 @@ unsigned confreadGetNumEntriesInSect(ConfigEntryPtr_t ce, const String section);
 /* Value functions */
 const String confreadGetValue(KeyEntryPtr_t ke);
 const String confreadValueBySectKey(ConfigEntryPtr_t ce, const String section, const String key);
+const String confreadValueBySectEntKey(SectionEntryPtr_t se, const String key);
 Bool confreadValueBySectKeyAsUnsigned(ConfigEntryPtr_t ce, const String section, const String key, unsigned *res);
 
 /*Default error handler*/
@@ -0,0 +1,138 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* dispbench.c
+*
+* LRR event and xPL command dispatch microbenchmark.
+*
+* Compares a linear strcmp scan of the lists, the way they used to be matched, against the
+* generated perfect hash tables.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "perfhash.h"
+#include "dispatch.h"
+
+#define DEF_MESSAGES 10000000
+
+/* Inputs, a mix of hits (late ones in the list too) and misses */
+
+static const char *inputs[] = {
+	"OPEN",
+	"ARM_AWAY",
+	"ALARM_PERIMETER",
+	"LOWBAT_RESTORE",
+	"CANCEL",
+	"TROUBLE",
+	"gatestat",
+	"zoneinfo",
+	"relaystat",
+	"disarm",
+	"arm-home",
+	"bogus"
+};
+
+#define INPUT_COUNT (sizeof(inputs) / sizeof(char *))
+
+/*
+* Return monotonic time in seconds
+*/
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+* Linear scan of a table's keys
+*/
+
+static int __attribute__ ((noinline)) linearLookup(const perfhashTable_t *t, const char *s)
+{
+	unsigned i;
+
+	for(i = 0; i < t->count; i++){
+		if(!strcmp(s, t->key[i]))
+			return i;
+	}
+	return -1;
+}
+
+/*
+* Perfect hash lookup
+*/
+
+static int __attribute__ ((noinline)) hashLookup(const perfhashTable_t *t, const char *s)
+{
+	return perfhash_lookup(t, s, strlen(s));
+}
+
+/*
+* Dispatch count inputs, each against all three tables as xplademco would for its message type
+*/
+
+static int bench(int (*lookup)(const perfhashTable_t *t, const char *s), unsigned long count)
+{
+	const char *s;
+	unsigned long i;
+	int sum = 0;
+
+	for(i = 0; i < count; i++){
+		s = inputs[i % INPUT_COUNT];
+		if(s[0] >= 'a')
+			sum += (*lookup)(&requestCommandTable, s) + (*lookup)(&basicCommandTable, s);
+		else
+			sum += (*lookup)(&lrrNameTable, s);
+	}
+	return sum;
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned long count = DEF_MESSAGES;
+	int r1, r2;
+	double t, t1, t2;
+
+	if(argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if(!count)
+		count = DEF_MESSAGES;
+
+	t = now();
+	r1 = bench(linearLookup, count);
+	t1 = now() - t;
+
+	t = now();
+	r2 = bench(hashLookup, count);
+	t2 = now() - t;
+
+	printf("Linear strcmp scan: %lu messages in %.3f s, %.1f ns/message\n", count, t1, t1 * 1e9 / count);
+	printf("Perfect hash:       %lu messages in %.3f s, %.1f ns/message\n", count, t2, t2 * 1e9 / count);
+	if(r1 != r2){
+		printf("Results differ: %d vs %d\n", r1, r2);
+		return 1;
+	}
+	return 0;
+}
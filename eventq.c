@@ -0,0 +1,231 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* eventq.c
+*
+* A prioritized queue of outbound events. Entries are filled in place, so queueing an event
+* copies its values and allocates nothing.
+*
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "types.h"
+#include "eventq.h"
+
+#define EVENTQ_MAGIC	0x7B20E5A1
+#define EVENTQ_MASK		(EVENTQ_DEPTH - 1)
+
+/*
+* Private function to make the eventfd readable
+*/
+
+static void eventq_signal(eventqPtr_t q)
+{
+	uint64_t one = 1;
+
+	if(!q->signalled)
+		q->signalled = (write(q->fd, &one, sizeof(one)) == sizeof(one));
+}
+
+/*
+* Allocate an event queue
+* Return NULL if out of memory or the eventfd could not be created.
+*/
+
+eventqPtr_t eventq_new(void)
+{
+	eventqPtr_t q;
+
+	if(!(q = calloc(1, sizeof(eventq_t))))
+		return NULL;
+	if((q->fd = eventfd(0, EFD_NONBLOCK)) < 0){
+		free(q);
+		return NULL;
+	}
+	q->magic = EVENTQ_MAGIC;
+	return q;
+}
+
+/*
+* Free an event queue
+*/
+
+void eventq_free(eventqPtr_t q)
+{
+	if(q && (q->magic == EVENTQ_MAGIC)){
+		close(q->fd);
+		q->magic = 0;
+		free(q);
+	}
+}
+
+/*
+* Return the fd which is readable while there are events queued
+*/
+
+int eventq_fd(eventqPtr_t q)
+{
+	return q->fd;
+}
+
+/*
+* Start a new event at the tail of a lane. It isn't queued until eventq_commit() is called.
+* Return NULL if the queue is full.
+*/
+
+eventqEntryPtr_t eventq_start(eventqPtr_t q, unsigned lane, void *target, uint64_t now)
+{
+	eventqLane_t *l = &q->lane[lane];
+	eventqEntryPtr_t e;
+
+	if(eventq_depth(q, EVENTQ_ALARM) + eventq_depth(q, EVENTQ_ROUTINE) == EVENTQ_DEPTH)
+		return NULL;
+	e = &l->entry[l->tail & EVENTQ_MASK];
+	e->target = target;
+	e->queued = now;
+	e->count = 0;
+	e->len = 0;
+	return e;
+}
+
+/*
+* Add a name-value pair to an event. The name must stay valid until the event is sent.
+* Return FALSE if there's no room for it.
+*/
+
+Bool eventq_add(eventqEntryPtr_t e, const char *name, const char *value)
+{
+	size_t len = strlen(value) + 1;
+
+	if((e->count == EVENTQ_MAX_VALUES) || (e->len + len > EVENTQ_TEXT_SIZE))
+		return FALSE;
+	e->name[e->count] = name;
+	e->value[e->count++] = e->len;
+	memcpy(e->text + e->len, value, len);
+	e->len += len;
+	return TRUE;
+}
+
+/*
+* Queue the event started on a lane
+*/
+
+void eventq_commit(eventqPtr_t q, unsigned lane)
+{
+	eventqLane_t *l = &q->lane[lane];
+	unsigned depth;
+
+	l->tail++;
+	q->queued++;
+	q->laneQueued[lane]++;
+	depth = eventq_depth(q, EVENTQ_ALARM) + eventq_depth(q, EVENTQ_ROUTINE);
+	if(depth > q->maxDepth)
+		q->maxDepth = depth;
+	eventq_signal(q);
+}
+
+/*
+* Return the next event to send, the oldest one in the highest priority lane, or NULL if the queue is empty
+*/
+
+eventqEntryPtr_t eventq_peek(eventqPtr_t q)
+{
+	unsigned i;
+
+	for(i = 0; i < EVENTQ_LANES; i++){
+		if(q->lane[i].tail != q->lane[i].head)
+			return &q->lane[i].entry[q->lane[i].head & EVENTQ_MASK];
+	}
+	return NULL;
+}
+
+/*
+* Remove the event eventq_peek() returned
+*/
+
+void eventq_pop(eventqPtr_t q)
+{
+	unsigned i;
+
+	for(i = 0; i < EVENTQ_LANES; i++){
+		if(q->lane[i].tail != q->lane[i].head){
+			q->lane[i].head++;
+			return;
+		}
+	}
+}
+
+/*
+* Drop the oldest event on a lane to make room, and count it
+* Return FALSE if the lane is empty.
+*/
+
+Bool eventq_drop(eventqPtr_t q, unsigned lane)
+{
+	eventqLane_t *l = &q->lane[lane];
+
+	if(l->tail == l->head)
+		return FALSE;
+	l->head++;
+	q->dropped[lane]++;
+	return TRUE;
+}
+
+/*
+* Reset the eventfd after it polled readable. It is made readable again if events are still queued.
+*/
+
+void eventq_ack(eventqPtr_t q)
+{
+	uint64_t count;
+
+	if(read(q->fd, &count, sizeof(count)) == sizeof(count))
+		q->signalled = FALSE;
+	if(eventq_peek(q))
+		eventq_signal(q);
+}
+
+/*
+* Return the number of events queued on a lane
+*/
+
+unsigned eventq_depth(eventqPtr_t q, unsigned lane)
+{
+	return q->lane[lane].tail - q->lane[lane].head;
+}
+
+/*
+* Return the time the oldest queued event was queued, or 0 if the queue is empty
+*/
+
+uint64_t eventq_oldest(eventqPtr_t q)
+{
+	uint64_t oldest = 0;
+	unsigned i;
+
+	for(i = 0; i < EVENTQ_LANES; i++){
+		if((q->lane[i].tail != q->lane[i].head) &&
+		((!oldest) || (q->lane[i].entry[q->lane[i].head & EVENTQ_MASK].queued < oldest)))
+			oldest = q->lane[i].entry[q->lane[i].head & EVENTQ_MASK].queued;
+	}
+	return oldest;
+}
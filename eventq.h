@@ -0,0 +1,93 @@
+/*
+*    Outbound event queue
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    event queue definitions.
+*
+*    Events wait here between being parsed from the serial port and being sent. Each event is a target
+*    (the message to send it with) and a list of name-value pairs, copied into the queue entry.
+*    There is a fixed size ring per priority lane, and the highest priority lane is always emptied first.
+*    The lanes share a limit of EVENTQ_DEPTH events. When it is reached, the owner makes room by dropping
+*    the oldest event of a lane with eventq_drop().
+*    An eventfd becomes readable while anything is queued, so the queue can be drained from a poll loop.
+*
+*/
+
+#ifndef EVENTQ_H
+#define EVENTQ_H
+
+#include <stdint.h>
+#include "types.h"
+
+#define EVENTQ_DEPTH 64			/* events queued in all lanes, and entries per lane, must be a power of 2 */
+#define EVENTQ_MAX_VALUES 40
+#define EVENTQ_TEXT_SIZE 1024
+
+/* Lanes, highest priority first */
+enum { EVENTQ_ALARM = 0, EVENTQ_ROUTINE, EVENTQ_LANES };
+
+/* Typedefs. */
+typedef struct eventq_entry eventqEntry_t;
+typedef eventqEntry_t * eventqEntryPtr_t;
+typedef struct eventq eventq_t;
+typedef eventq_t * eventqPtr_t;
+
+/* One queued event */
+struct eventq_entry {
+	void *target;							/* what to send it with */
+	uint64_t queued;						/* time it was queued, in microseconds */
+	unsigned count;							/* number of name-value pairs */
+	unsigned len;							/* bytes used in text */
+	const char *name[EVENTQ_MAX_VALUES];	/* names, these are not copied */
+	unsigned value[EVENTQ_MAX_VALUES];		/* offset of each value in text */
+	char text[EVENTQ_TEXT_SIZE];			/* the nul terminated values */
+};
+
+/* A lane */
+typedef struct {
+	unsigned head;
+	unsigned tail;
+	eventqEntry_t entry[EVENTQ_DEPTH];
+} eventqLane_t;
+
+/* The queue */
+struct eventq {
+	unsigned magic;
+	int fd;
+	Bool signalled;
+	unsigned maxDepth;
+	unsigned long queued;
+	unsigned long laneQueued[EVENTQ_LANES];
+	unsigned long dropped[EVENTQ_LANES];
+	eventqLane_t lane[EVENTQ_LANES];
+};
+
+/* Prototypes. */
+eventqPtr_t eventq_new(void);
+void eventq_free(eventqPtr_t q);
+int eventq_fd(eventqPtr_t q);
+eventqEntryPtr_t eventq_start(eventqPtr_t q, unsigned lane, void *target, uint64_t now);
+Bool eventq_add(eventqEntryPtr_t e, const char *name, const char *value);
+void eventq_commit(eventqPtr_t q, unsigned lane);
+eventqEntryPtr_t eventq_peek(eventqPtr_t q);
+void eventq_pop(eventqPtr_t q);
+Bool eventq_drop(eventqPtr_t q, unsigned lane);
+void eventq_ack(eventqPtr_t q);
+unsigned eventq_depth(eventqPtr_t q, unsigned lane);
+uint64_t eventq_oldest(eventqPtr_t q);
+
+#endif
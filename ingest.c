@@ -0,0 +1,276 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* ingest.c
+*
+* Serial ingestion thread. The thread is the only reader of the serial port, and the main thread
+* is the only reader of the ring. The ring indexes are free running, each side writes only its own,
+* and the other side reads it with acquire ordering, so no locks are needed.
+*
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "types.h"
+#include "capture.h"
+#include "notify.h"
+#include "ingest.h"
+
+#define ERROR -1
+
+#define INGEST_MAGIC	0x49E6C2D7
+#define INGEST_MASK		(INGEST_DEPTH - 1)
+#define INGEST_STALL_MS	1
+#define INGEST_STOP_MS	250		/* how often the thread checks the stop flag when idle */
+
+/*
+* Private function to wake the consumer
+*/
+
+static void ingest_signal(ingestPtr_t in)
+{
+	uint64_t one = 1;
+
+	if(write(in->fd, &one, sizeof(one)) != sizeof(one))
+		return; /* Counter saturated, it's readable anyway */
+}
+
+/*
+* Private function to check if the thread has been told to stop
+*/
+
+static Bool ingest_stopping(ingestPtr_t in)
+{
+	return __atomic_load_n(&in->stop, __ATOMIC_ACQUIRE) ? TRUE : FALSE;
+}
+
+/*
+* Private function to wait for the consumer to make room in the ring
+* Return FALSE if the thread was told to stop while waiting.
+*/
+
+static Bool ingest_wait(ingestPtr_t in, unsigned tail)
+{
+	struct pollfd stop = { in->stopFD, POLLIN, 0 };
+
+	while(tail - __atomic_load_n(&in->head, __ATOMIC_ACQUIRE) == INGEST_DEPTH){
+		__atomic_fetch_add(&in->stalls, 1, __ATOMIC_RELAXED);
+		if((poll(&stop, 1, INGEST_STALL_MS) > 0) || ingest_stopping(in))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+* The ingestion thread
+*/
+
+static void *ingest_thread(void *arg)
+{
+	ingestPtr_t in = arg;
+	struct pollfd pfd[2];
+	serioView_t view;
+	ingestSlot_t *s;
+	unsigned tail, n;
+	uint64_t now;
+	int res;
+
+	pfd[0].fd = serio_fd(in->serio);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = in->stopFD;
+	pfd[1].events = POLLIN;
+
+	for(;;){
+		/* The stop fd wakes us at once, the timeout is the fallback if it could not be written */
+		if((res = poll(pfd, 2, INGEST_STOP_MS)) < 0){
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(pfd[1].revents || ingest_stopping(in))
+			return NULL; /* Told to stop */
+		if(!res)
+			continue;
+
+		now = capture_now_us();
+		tail = in->tail;
+		n = 0;
+
+		/* Copy every buffered line into the ring */
+		while((res = serio_nb_line_view(in->serio, &view)) != 0){
+			if((res < 0) || serio_ateof(in->serio))
+				goto lost;
+			if(tail - __atomic_load_n(&in->head, __ATOMIC_ACQUIRE) == INGEST_DEPTH){
+				/* Full, make sure the consumer knows about what's there, then wait for it */
+				if(n)
+					ingest_signal(in);
+				n = 0;
+				if(!ingest_wait(in, tail))
+					return NULL;
+			}
+			s = &in->slot[tail & INGEST_MASK];
+			if(view.len > INGEST_LINE_MAX - 1)
+				view.len = INGEST_LINE_MAX - 1;
+			memcpy(s->text, view.text, view.len);
+			s->text[view.len] = 0;
+			s->len = view.len;
+			s->time = now;
+			__atomic_store_n(&in->tail, ++tail, __ATOMIC_RELEASE);
+			__atomic_fetch_add(&in->lines, 1, __ATOMIC_RELAXED);
+			n++;
+		}
+		if(n)
+			ingest_signal(in);
+	}
+
+lost:
+	/* EOF or error, the consumer sees this after it has taken the lines already in the ring */
+	__atomic_store_n(&in->done, TRUE, __ATOMIC_RELEASE);
+	ingest_signal(in);
+	return NULL;
+}
+
+/*
+* Start an ingestion thread on a serial port.
+* The thread only reads the port. Writes are still done by the caller.
+* Return NULL if out of memory or the thread could not be started.
+*/
+
+ingestPtr_t ingest_start(serioStuffPtr_t serio)
+{
+	ingestPtr_t in;
+	sigset_t all, old;
+	int res;
+
+	if(!(in = calloc(1, sizeof(ingest_t))))
+		return NULL;
+	in->serio = serio;
+	in->fd = eventfd(0, EFD_NONBLOCK);
+	in->stopFD = eventfd(0, EFD_NONBLOCK);
+	if((in->fd < 0) || (in->stopFD < 0))
+		goto fail;
+
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	res = pthread_create(&in->thread, NULL, ingest_thread, in);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(res)
+		goto fail;
+
+	in->magic = INGEST_MAGIC;
+	return in;
+
+fail:
+	if(in->fd >= 0)
+		close(in->fd);
+	if(in->stopFD >= 0)
+		close(in->stopFD);
+	free(in);
+	return NULL;
+}
+
+/*
+* Stop an ingestion thread and free it. The serial port is left open.
+* This always waits for the thread to exit, so the port can be closed safely afterwards.
+*/
+
+void ingest_stop(ingestPtr_t in)
+{
+	uint64_t one = 1;
+
+	if(in && (in->magic == INGEST_MAGIC)){
+		__atomic_store_n(&in->stop, TRUE, __ATOMIC_RELEASE);
+		if(write(in->stopFD, &one, sizeof(one)) != sizeof(one))
+			debug(DEBUG_UNEXPECTED, "Could not signal the ingestion thread, waiting for it to see the stop flag");
+		pthread_join(in->thread, NULL);
+		close(in->fd);
+		close(in->stopFD);
+		in->magic = 0;
+		free(in);
+	}
+}
+
+/*
+* Return the fd which is readable while lines are waiting
+*/
+
+int ingest_fd(ingestPtr_t in)
+{
+	return in->fd;
+}
+
+/*
+* Reset the eventfd after it polled readable.
+* Call this before taking the lines, so any line added afterwards makes it readable again.
+*/
+
+void ingest_ack(ingestPtr_t in)
+{
+	uint64_t count;
+
+	if(read(in->fd, &count, sizeof(count)) != sizeof(count))
+		return;
+}
+
+/*
+* Get the next line from the ring. The view stays valid until ingest_release() is called.
+* Return 1 on a line, 0 if the ring is empty, and -1 if it is empty and the thread hit EOF or an error.
+*/
+
+int ingest_next(ingestPtr_t in, serioView_t *view, uint64_t *time)
+{
+	ingestSlot_t *s;
+	unsigned done;
+
+	/* Load done first, everything the thread put in the ring before setting it is then visible */
+	done = __atomic_load_n(&in->done, __ATOMIC_ACQUIRE);
+	if(in->head == __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE))
+		return done ? ERROR : FALSE;
+
+	s = &in->slot[in->head & INGEST_MASK];
+	view->text = s->text;
+	view->len = s->len;
+	*time = s->time;
+	return TRUE;
+}
+
+/*
+* Give the line ingest_next() returned back to the thread
+*/
+
+void ingest_release(ingestPtr_t in)
+{
+	__atomic_store_n(&in->head, in->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+* Return the counters, they are updated by the thread while this runs
+*/
+
+void ingest_get_stats(ingestPtr_t in, unsigned long *lines, unsigned long *stalls)
+{
+	*lines = __atomic_load_n(&in->lines, __ATOMIC_RELAXED);
+	*stalls = __atomic_load_n(&in->stalls, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,75 @@
+/*
+*    Serial ingestion thread
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    ingestion thread definitions.
+*
+*    A thread owns the receive side of a serial port. It frames the lines and hands them over
+*    to the main thread through a single producer, single consumer ring, so the serial port is read
+*    promptly even while the main thread is busy. An eventfd becomes readable when lines are waiting.
+*
+*/
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "types.h"
+#include "serio.h"
+
+#define INGEST_DEPTH 256			/* lines in the ring, must be a power of 2 */
+#define INGEST_LINE_MAX SERIO_MAX_LINE
+
+/* Typedefs. */
+typedef struct ingest_slot ingestSlot_t;
+typedef struct ingest ingest_t;
+typedef ingest_t * ingestPtr_t;
+
+/* One received line */
+struct ingest_slot {
+	uint64_t time;					/* time it was read, in microseconds */
+	unsigned len;
+	char text[INGEST_LINE_MAX];		/* nul terminated */
+};
+
+/* The ingestion thread and its ring */
+struct ingest {
+	unsigned magic;
+	serioStuffPtr_t serio;
+	pthread_t thread;
+	int fd;							/* readable when lines are waiting */
+	int stopFD;						/* readable when the thread is to exit */
+	unsigned head;					/* written by the consumer only */
+	unsigned tail;					/* written by the thread only */
+	unsigned done;					/* set by the thread on EOF or error */
+	unsigned stop;					/* set by ingest_stop(), polled by the thread */
+	unsigned long lines;			/* the counters are updated atomically, read them with ingest_get_stats() */
+	unsigned long stalls;			/* times the thread waited on a full ring */
+	ingestSlot_t slot[INGEST_DEPTH];
+};
+
+/* Prototypes. */
+ingestPtr_t ingest_start(serioStuffPtr_t serio);
+void ingest_stop(ingestPtr_t in);
+int ingest_fd(ingestPtr_t in);
+void ingest_ack(ingestPtr_t in);
+int ingest_next(ingestPtr_t in, serioView_t *view, uint64_t *time);
+void ingest_release(ingestPtr_t in);
+void ingest_get_stats(ingestPtr_t in, unsigned long *lines, unsigned long *stalls);
+
+#endif
@@ -0,0 +1,341 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* keypad.c
+*
+* Split an ad2usb keypad message into its fields in one pass over the line.
+*
+* The message layout is described by the field table below. Each field is checked against a
+* character class table as it is scanned, and converted in the same loop, so nothing is allocated
+* and no character is looked at twice.
+*
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "keypad.h"
+
+/* Character classes */
+#define CC_DIGIT	0x01
+#define CC_HEX		0x02
+#define CC_BIT		0x04
+#define CC_TEXT		0x08
+
+#define KC_MAGIC	0x4B3D6A91
+
+/* Field types */
+enum { KF_BITS, KF_NUMBER, KF_RAW, KF_ALPHA };
+
+typedef struct keypad_field keypadField_t;
+
+struct keypad_field {
+	unsigned type;
+	char open;			/* opening delimiter, 0 if none */
+	char close;			/* closing delimiter */
+	uint8_t class;		/* allowed characters */
+	unsigned min;		/* length limits */
+	unsigned max;
+};
+
+/* Keypad message layout, the fields are separated by commas */
+
+static const keypadField_t keypadFields[] = {
+	{ KF_BITS, '[', ']', CC_BIT, KEYPAD_BITS_LEN, KEYPAD_BITS_LEN },
+	{ KF_NUMBER, 0, ',', CC_HEX, 1, 8 },
+	{ KF_RAW, '[', ']', CC_HEX, 2, KEYPAD_RAW_MAX * 2 },
+	{ KF_ALPHA, '"', '"', CC_TEXT, 0, KEYPAD_ALPHA_MAX }
+};
+
+#define FIELD_COUNT (sizeof(keypadFields) / sizeof(keypadField_t))
+
+static uint8_t charClass[256];
+static uint8_t hexValue[256];
+static Bool tablesBuilt = FALSE;
+
+
+/*
+* Build the character class and hex value tables
+*/
+
+static void build_tables(void)
+{
+	unsigned c;
+
+	for(c = 0x20; c < 0x7F; c++)
+		charClass[c] = CC_TEXT;
+	charClass['"'] = 0;
+
+	for(c = '0'; c <= '9'; c++){
+		charClass[c] |= CC_DIGIT | CC_HEX | CC_BIT;
+		hexValue[c] = c - '0';
+	}
+	for(c = 'a'; c <= 'f'; c++){
+		charClass[c] |= CC_HEX;
+		charClass[c - 'a' + 'A'] |= CC_HEX;
+		hexValue[c] = hexValue[c - 'a' + 'A'] = c - 'a' + 10;
+	}
+
+	/* Status characters: flags, the beep count, the panel type, and unused positions */
+	for(c = 'A'; c <= 'Z'; c++)
+		charClass[c] |= CC_BIT;
+	charClass['-'] |= CC_BIT;
+
+	tablesBuilt = TRUE;
+}
+
+/*
+* Parse a keypad message of len characters into msg.
+* Return TRUE if it was well formed.
+*/
+
+Bool keypad_parse(const char *line, unsigned len, keypadMsgPtr_t msg)
+{
+	const keypadField_t *f;
+	const uint8_t *p = (const uint8_t *) line;
+	const uint8_t *end = p + len;
+	const uint8_t *start;
+	unsigned i, n, number;
+	Bool decimal;
+	uint8_t cc;
+
+	if((!line) || (!msg))
+		return FALSE;
+
+	if(!tablesBuilt)
+		build_tables();
+
+	for(i = 0; i < FIELD_COUNT; i++){
+		f = &keypadFields[i];
+
+		/* Separator and opening delimiter */
+		if(i && ((p >= end) || (*p++ != ',')))
+			return FALSE;
+		if(f->open && ((p >= end) || (*p++ != f->open)))
+			return FALSE;
+
+		/* Scan and convert the field */
+		start = p;
+		number = 0;
+		decimal = TRUE;
+		for(; (p < end) && (*p != f->close); p++){
+			cc = charClass[*p];
+			if(!(cc & f->class))
+				return FALSE;
+			if(f->type == KF_NUMBER){
+				if(!(cc & CC_DIGIT))
+					decimal = FALSE;
+				number = (number * 10) + hexValue[*p];
+			}
+			else if((f->type == KF_RAW) && ((p - start) & 1) && ((p - start) < KEYPAD_RAW_MAX * 2))
+				msg->raw[(p - start) >> 1] = (hexValue[p[-1]] << 4) | hexValue[*p];
+		}
+		n = p - start;
+		if((n < f->min) || (n > f->max))
+			return FALSE;
+
+		/* Closing delimiter, the number field is closed by the next separator */
+		if(f->open){
+			if(p >= end)
+				return FALSE;
+			p++;
+		}
+
+		switch(f->type){
+			case KF_BITS:
+				msg->bits = (const char *) start;
+				break;
+
+			case KF_NUMBER:
+				msg->numberText = (const char *) start;
+				msg->numberLen = n;
+				msg->number = decimal ? number : KEYPAD_NO_NUMBER;
+				break;
+
+			case KF_RAW:
+				if(n & 1)
+					return FALSE;
+				msg->rawLen = n >> 1;
+				break;
+
+			case KF_ALPHA:
+				while(n && (start[n - 1] == ' '))
+					n--;
+				msg->alpha = (const char *) start;
+				msg->alphaLen = n;
+				break;
+		}
+	}
+
+	/* Nothing may follow the display text */
+	return (p == end) ? TRUE : FALSE;
+}
+
+/*
+* Private function to pack up to 8 status characters loaded into a word, bit n set if byte n is a '1'.
+* The bytes equal to '1' become zero, the zero bytes get their top bit set,
+* and the multiply gathers the top bits into the top byte.
+*/
+
+static inline uint32_t keypad_pack8(uint64_t w)
+{
+	const uint64_t lo7 = 0x7F7F7F7F7F7F7F7FULL;
+	uint64_t t;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	w = __builtin_bswap64(w);
+#endif
+	w ^= 0x3131313131313131ULL;
+	t = ~(((w & lo7) + lo7) | w | lo7);
+	return (uint32_t) (((t >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+/*
+* Pack the KEYPAD_BITS_LEN status characters into a word, bit n set if character n is a '1'
+*/
+
+uint32_t keypad_pack_bits(const char *bits)
+{
+	uint64_t w0, w1, w2 = 0;
+
+#if KEYPAD_BITS_LEN != 20
+#error keypad_pack_bits() loads exactly 20 status characters
+#endif
+	memcpy(&w0, bits, 8);
+	memcpy(&w1, bits + 8, 8);
+	memcpy(&w2, bits + 16, 4);
+	return keypad_pack8(w0) | (keypad_pack8(w1) << 8) | (keypad_pack8(w2) << 16);
+}
+
+/*
+* Return TRUE if the display is showing a zone fault
+*/
+
+Bool keypad_is_fault(const keypadMsg_t *msg)
+{
+	return ((msg->alphaLen >= 5) && (!memcmp(msg->alpha, "FAULT", 5)) &&
+	(msg->number != KEYPAD_NO_NUMBER)) ? TRUE : FALSE;
+}
+
+/*
+* Hash a line 8 bytes at a time
+*/
+
+uint32_t keypad_hash(const char *line, unsigned len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+	uint64_t w;
+
+	for(; len >= 8; line += 8, len -= 8){
+		memcpy(&w, line, 8);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	if(len){
+		w = 0;
+		memcpy(&w, line, len);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+	}
+	h ^= h >> 29;
+	return (uint32_t) h;
+}
+
+/*
+* Allocate a keypad message cache. Entries are valid for window_ms milliseconds.
+* Return NULL if out of memory.
+*/
+
+keypadCachePtr_t keypad_cache_new(unsigned window_ms)
+{
+	keypadCachePtr_t cache;
+
+	if(!(cache = calloc(1, sizeof(keypadCache_t))))
+		return NULL;
+	cache->magic = KC_MAGIC;
+	cache->window = (uint64_t) window_ms * 1000;
+	return cache;
+}
+
+/*
+* Free a keypad message cache
+*/
+
+void keypad_cache_free(keypadCachePtr_t cache)
+{
+	if(cache && (cache->magic == KC_MAGIC)){
+		cache->magic = 0;
+		free(cache);
+	}
+}
+
+/*
+* Make the next message count as new even if it repeats the previous one.
+* Used when state outside the keypad message changes what the message means.
+*/
+
+void keypad_cache_forget_last(keypadCachePtr_t cache)
+{
+	if(cache && (cache->magic == KC_MAGIC))
+		cache->last = NULL;
+}
+
+/*
+* Look up a keypad message seen at time now (in us), and parse it if it isn't in the cache.
+*
+* Return the parse results, or NULL if the message is malformed. *repeat is set TRUE if the
+* message is byte identical to the previous one, in which case it carries no new information.
+*/
+
+const keypadMsg_t *keypad_cache_lookup(keypadCachePtr_t cache, const char *line, unsigned len, uint64_t now, Bool *repeat)
+{
+	keypadCacheEntryPtr_t e;
+	uint32_t hash;
+
+	*repeat = FALSE;
+	if((!cache) || (cache->magic != KC_MAGIC) || (len >= KEYPAD_LINE_MAX))
+		return NULL;
+
+	hash = keypad_hash(line, len);
+	e = &cache->entry[hash & (KEYPAD_CACHE_SIZE - 1)];
+
+	if((e->len == len) && (e->hash == hash) && (now - e->seen < cache->window) &&
+	(!memcmp(e->line, line, len))){
+		cache->hits++;
+		if(e == cache->last){
+			cache->repeats++;
+			*repeat = TRUE;
+		}
+	}
+	else{
+		/* Parse a copy, so the results stay valid as long as the entry does */
+		cache->misses++;
+		memcpy(e->line, line, len);
+		e->line[len] = 0;
+		if(!keypad_parse(e->line, len, &e->msg)){
+			e->len = 0;
+			cache->last = NULL;
+			return NULL;
+		}
+		e->len = len;
+		e->hash = hash;
+	}
+	e->seen = now;
+	cache->last = e;
+	return &e->msg;
+}
@@ -0,0 +1,112 @@
+/*
+*    Keypad message parser
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    keypad message definitions.
+*
+*    An ad2usb keypad message looks like this:
+*
+*    [1000000100000000----],008,[f70000051008001c08020000000000],"FAULT 08 GARAGE DOOR            "
+*
+*    The status bits, the zone or user number, the raw panel data in hex, and the 32 character display text.
+*
+*/
+
+#ifndef KEYPAD_H
+#define KEYPAD_H
+
+#include <stdint.h>
+#include "types.h"
+
+#define KEYPAD_BITS_LEN 20
+#define KEYPAD_RAW_MAX 16
+#define KEYPAD_ALPHA_MAX 32
+#define KEYPAD_NO_NUMBER 0xFFFFFFFF
+#define KEYPAD_LINE_MAX 128
+#define KEYPAD_CACHE_SIZE 8
+
+/* Status bit masks, bit n is set when status character n is a '1' */
+#define KEYPAD_READY			0x00001
+#define KEYPAD_ARMED_AWAY		0x00002
+#define KEYPAD_ARMED_HOME		0x00004
+#define KEYPAD_BACKLIGHT		0x00008
+#define KEYPAD_PROGRAMMING		0x00010
+#define KEYPAD_BEEP				0x00020
+#define KEYPAD_BYPASSED			0x00040
+#define KEYPAD_AC_POWER			0x00080
+#define KEYPAD_CHIME			0x00100
+#define KEYPAD_ALARM_OCCURRED	0x00200
+#define KEYPAD_ALARM_BELL		0x00400
+#define KEYPAD_LOW_BATTERY		0x00800
+#define KEYPAD_ENTRY_DELAY_OFF	0x01000
+#define KEYPAD_FIRE				0x02000
+#define KEYPAD_CHECK_ZONE		0x04000
+#define KEYPAD_PERIMETER_ONLY	0x08000
+#define KEYPAD_ALL_BITS			0xFFFFF
+
+/* Typedefs. */
+typedef struct keypad_msg keypadMsg_t;
+typedef keypadMsg_t * keypadMsgPtr_t;
+
+/* One parsed keypad message. The text fields point into the line which was parsed. */
+struct keypad_msg {
+	const char *bits;				/* KEYPAD_BITS_LEN status characters */
+	unsigned number;				/* zone or user number, KEYPAD_NO_NUMBER if not decimal */
+	const char *numberText;			/* number field as sent */
+	unsigned numberLen;
+	unsigned rawLen;				/* number of bytes in raw */
+	uint8_t raw[KEYPAD_RAW_MAX];	/* raw panel data */
+	const char *alpha;				/* display text, without the quotes */
+	unsigned alphaLen;				/* display text length with trailing spaces removed */
+};
+
+typedef struct keypad_cache_entry keypadCacheEntry_t;
+typedef keypadCacheEntry_t * keypadCacheEntryPtr_t;
+typedef struct keypad_cache keypadCache_t;
+typedef keypadCache_t * keypadCachePtr_t;
+
+/* A recently seen keypad message, with its parse results pointing into the copy of the line */
+struct keypad_cache_entry {
+	uint32_t hash;					/* hash of the line */
+	unsigned len;					/* line length, 0 if unused */
+	uint64_t seen;					/* time last seen in us */
+	keypadMsg_t msg;
+	char line[KEYPAD_LINE_MAX];
+};
+
+/* Cache of recently seen keypad messages */
+struct keypad_cache {
+	unsigned magic;					/* magic number */
+	uint64_t window;				/* how long an entry stays valid in us, 0 disables the cache */
+	keypadCacheEntryPtr_t last;		/* entry for the previous message */
+	unsigned long hits;				/* messages which did not need parsing */
+	unsigned long repeats;			/* hits which were the same as the previous message */
+	unsigned long misses;			/* messages which were parsed */
+	keypadCacheEntry_t entry[KEYPAD_CACHE_SIZE];
+};
+
+/* Prototypes. */
+Bool keypad_parse(const char *line, unsigned len, keypadMsgPtr_t msg);
+Bool keypad_is_fault(const keypadMsg_t *msg);
+uint32_t keypad_pack_bits(const char *bits);
+uint32_t keypad_hash(const char *line, unsigned len);
+keypadCachePtr_t keypad_cache_new(unsigned window_ms);
+void keypad_cache_free(keypadCachePtr_t cache);
+void keypad_cache_forget_last(keypadCachePtr_t cache);
+const keypadMsg_t *keypad_cache_lookup(keypadCachePtr_t cache, const char *line, unsigned len, uint64_t now, Bool *repeat);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* kpbench.c
+*
+* Keypad status bit decoding microbenchmark.
+*
+* Compares decoding the status characters with individual character compares on every message
+* against packing them into a word when they changed, and running only the handlers for the bits which changed.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "types.h"
+#include "keypad.h"
+
+#define DEF_MESSAGES 10000000
+
+#define ARMED_BITS	(KEYPAD_ARMED_AWAY | KEYPAD_ARMED_HOME | KEYPAD_ENTRY_DELAY_OFF | KEYPAD_PERIMETER_ONLY)
+#define ALARM_BITS	(KEYPAD_ALARM_BELL | KEYPAD_FIRE)
+
+typedef struct {
+	unsigned armed : 1;
+	unsigned alarm : 1;
+	unsigned acfail : 1;
+	unsigned lowbatt : 1;
+	unsigned ready : 1;
+} benchBits_t;
+
+typedef struct {
+	uint32_t mask;
+	void (*handler)(benchBits_t *sb, uint32_t word);
+} benchHandler_t;
+
+/* A panel mostly repeats itself, the bits change now and then */
+
+static const char *statusStrings[] = {
+	"1001000100000000----",
+	"1001000100000000----",
+	"1001000100000000----",
+	"1001000100000000----",
+	"1001000100000000----",
+	"1001000100000000----",
+	"1001000100000000----",
+	"1001000100000000----",
+	"0101000100000000----",
+	"0101000100000000----",
+	"0101000100000000----",
+	"0101000100000000----",
+	"0101000100000000----",
+	"0101000100000000----",
+	"0101000100000000----",
+	"0101000100000000----"
+};
+
+#define STATUS_COUNT (sizeof(statusStrings) / sizeof(char *))
+
+static void hReady(benchBits_t *sb, uint32_t word) { sb->ready = (word & KEYPAD_READY) ? 1 : 0; }
+static void hArmed(benchBits_t *sb, uint32_t word) { sb->armed = (word & ARMED_BITS) ? 1 : 0; }
+static void hAlarm(benchBits_t *sb, uint32_t word) { sb->alarm = (word & ALARM_BITS) ? 1 : 0; }
+static void hACFail(benchBits_t *sb, uint32_t word) { sb->acfail = (word & KEYPAD_AC_POWER) ? 0 : 1; }
+static void hLowBatt(benchBits_t *sb, uint32_t word) { sb->lowbatt = (word & KEYPAD_LOW_BATTERY) ? 1 : 0; }
+
+static const benchHandler_t handlers[] = {
+	{ KEYPAD_READY, hReady },
+	{ ARMED_BITS, hArmed },
+	{ ALARM_BITS, hAlarm },
+	{ KEYPAD_AC_POWER, hACFail },
+	{ KEYPAD_LOW_BATTERY, hLowBatt },
+	{ 0, NULL }
+};
+
+/*
+* Return monotonic time in seconds
+*/
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+* Character compares on every message, the way serioHandler used to decode them
+*/
+
+static void __attribute__ ((noinline)) decodeStrings(benchBits_t *sb, char *oldStatBits, const char *s, unsigned *changes)
+{
+	if(memcmp(s, oldStatBits, 20)){
+		memcpy(oldStatBits, s, 20);
+		(*changes)++;
+	}
+	sb->ready = (s[0] == '1') ? 1 : 0;
+	sb->armed = ((s[1] == '1') || (s[2] == '1') || (s[12] == '1') || (s[15] == '1')) ? 1 : 0;
+	sb->alarm = ((s[10] == '1') || (s[13] == '1')) ? 1 : 0;
+	sb->acfail = (s[7] == '0') ? 1 : 0;
+	sb->lowbatt = (s[11] == '1') ? 1 : 0;
+}
+
+/*
+* Character compare, then a packed word and XOR change detection when something changed.
+* Only the handlers for the changed bits are run, the way serioHandler decodes them.
+*/
+
+static void __attribute__ ((noinline)) decodePacked(benchBits_t *sb, char *oldStatBits, uint32_t *old, const char *s, unsigned *changes)
+{
+	const benchHandler_t *h;
+	uint32_t word, changed;
+
+	if(!memcmp(s, oldStatBits, KEYPAD_BITS_LEN))
+		return;
+	memcpy(oldStatBits, s, KEYPAD_BITS_LEN);
+	word = keypad_pack_bits(s);
+	changed = word ^ *old;
+	if(changed){
+		*old = word;
+		(*changes)++;
+		for(h = handlers; h->handler; h++){
+			if(changed & h->mask)
+				(*h->handler)(sb, word);
+		}
+	}
+}
+
+/*
+* Return a checksum of the final state, so both methods can be checked against each other
+*/
+
+static unsigned checksum(benchBits_t *sb, unsigned changes)
+{
+	return (changes << 5) | (sb->ready << 4) | (sb->armed << 3) | (sb->alarm << 2) | (sb->acfail << 1) | sb->lowbatt;
+}
+
+static unsigned benchStrings(unsigned long count)
+{
+	char oldStatBits[21];
+	benchBits_t sb = {0};
+	unsigned changes = 0;
+	unsigned long i;
+
+	memcpy(oldStatBits, statusStrings[0], 21);
+	for(i = 0; i < count; i++)
+		decodeStrings(&sb, oldStatBits, statusStrings[i % STATUS_COUNT], &changes);
+	return checksum(&sb, changes);
+}
+
+static unsigned benchPacked(unsigned long count)
+{
+	const benchHandler_t *h;
+	char oldStatBits[KEYPAD_BITS_LEN];
+	benchBits_t sb = {0};
+	uint32_t old;
+	unsigned changes = 0;
+	unsigned long i;
+
+	memcpy(oldStatBits, statusStrings[0], KEYPAD_BITS_LEN);
+	old = keypad_pack_bits(statusStrings[0]);
+	for(h = handlers; h->handler; h++)
+		(*h->handler)(&sb, old);
+	for(i = 0; i < count; i++)
+		decodePacked(&sb, oldStatBits, &old, statusStrings[i % STATUS_COUNT], &changes);
+	return checksum(&sb, changes);
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned long count = DEF_MESSAGES;
+	unsigned r1, r2;
+	double t, t1, t2;
+
+	if(argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if(!count)
+		count = DEF_MESSAGES;
+
+	t = now();
+	r1 = benchStrings(count);
+	t1 = now() - t;
+
+	t = now();
+	r2 = benchPacked(count);
+	t2 = now() - t;
+
+	printf("Character compares:  %lu messages in %.3f s, %.0f messages/sec\n", count, t1, count / t1);
+	printf("Compare, pack + XOR: %lu messages in %.3f s, %.0f messages/sec\n", count, t2, count / t2);
+	if(r1 != r2){
+		printf("Results differ: %u vs %u\n", r1, r2);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* nodewatch.c
+*
+* Watch for a device node (or the symlink to it) reappearing using inotify.
+*
+* The directory holding the node is watched. If that directory is gone too (e.g. /dev/serial/by-id
+* disappears with the last USB serial adapter), the closest existing parent is watched instead, and
+* the caller re-adds the watch on each event so it moves back down as the directories reappear.
+*
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "types.h"
+#include "nodewatch.h"
+#include "notify.h"
+
+#define WATCH_MASK (IN_CREATE | IN_ATTRIB | IN_MOVED_TO)
+
+
+/*
+* Open the inotify instance.
+* Return the fd to poll on, or -1 if inotify isn't available.
+*/
+
+int nodewatch_open(void)
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if(fd < 0)
+		debug(DEBUG_UNEXPECTED, "inotify not available: %s", strerror(errno));
+	return fd;
+}
+
+
+/*
+* Watch the closest existing directory above path.
+* Return the watch descriptor, or -1 on error.
+*/
+
+int nodewatch_add(int fd, const char *path)
+{
+	char dir[PATH_MAX];
+	struct stat s;
+	char *p;
+	int wd;
+
+	if((fd < 0) || (!path) || (strlen(path) >= PATH_MAX))
+		return -1;
+
+	strcpy(dir, path);
+	for(;;){
+		/* Strip the last path component */
+		if(!(p = strrchr(dir, '/')))
+			strcpy(dir, ".");
+		else if(p == dir)
+			dir[1] = 0;
+		else
+			*p = 0;
+
+		if((stat(dir, &s) == 0) && S_ISDIR(s.st_mode))
+			break;
+		if((!strcmp(dir, "/")) || (!strcmp(dir, ".")))
+			return -1;
+	}
+
+	if((wd = inotify_add_watch(fd, dir, WATCH_MASK)) < 0){
+		debug(DEBUG_UNEXPECTED, "Can't watch %s: %s", dir, strerror(errno));
+		return -1;
+	}
+	debug(DEBUG_ACTION, "Watching %s for %s", dir, path);
+	return wd;
+}
+
+/*
+* Stop watching
+*/
+
+void nodewatch_remove(int fd, int wd)
+{
+	if((fd >= 0) && (wd >= 0))
+		inotify_rm_watch(fd, wd);
+}
+
+/*
+* Read and discard all pending events.
+* Return TRUE if there were any.
+*/
+
+Bool nodewatch_drain(int fd)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	Bool res = FALSE;
+
+	if(fd < 0)
+		return FALSE;
+
+	while(read(fd, buf, sizeof(buf)) > 0)
+		res = TRUE;
+	return res;
+}
@@ -0,0 +1,35 @@
+/*
+*    Device node watch functions
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    node watch definitions.
+*
+*
+*/
+
+#ifndef NODEWATCH_H
+#define NODEWATCH_H
+
+#include "types.h"
+
+/* Prototypes. */
+int nodewatch_open(void);
+int nodewatch_add(int fd, const char *path);
+void nodewatch_remove(int fd, int wd);
+Bool nodewatch_drain(int fd);
+
+#endif
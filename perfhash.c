@@ -0,0 +1,62 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* perfhash.c
+*
+* Perfect hash table lookup. phgen uses the same hash function to build the tables.
+*
+*/
+
+#include <string.h>
+#include "perfhash.h"
+
+
+/*
+* Hash len characters of s with a seed (FNV-1a with a final mix)
+*/
+
+uint32_t perfhash_hash(uint32_t seed, const char *s, unsigned len)
+{
+	uint32_t h = 2166136261U ^ seed;
+
+	while(len--){
+		h ^= (unsigned char) *s++;
+		h *= 16777619U;
+	}
+	h ^= h >> 15;
+	h *= 0x2C1B3C6DU;
+	h ^= h >> 13;
+	return h;
+}
+
+/*
+* Look up len characters of s in a table.
+* Return the key index, or -1 if it isn't in the table.
+*/
+
+int perfhash_lookup(const perfhashTable_t *t, const char *s, unsigned len)
+{
+	int i;
+
+	if((!t) || (!s))
+		return -1;
+
+	i = t->slot[perfhash_hash(t->seed, s, len) & t->mask];
+	if((i < 0) || (t->keyLen[i] != len) || memcmp(t->key[i], s, len))
+		return -1;
+	return i;
+}
@@ -0,0 +1,50 @@
+/*
+*    Perfect hash table lookup
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    perfect hash definitions.
+*
+*    The tables are generated at build time by phgen from dispatch.def. phgen searches for a seed which
+*    puts every key of a table in its own slot, so a lookup is one hash and one compare.
+*
+*/
+
+#ifndef PERFHASH_H
+#define PERFHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Typedefs. */
+typedef struct perfhash_table perfhashTable_t;
+
+/* A generated table */
+struct perfhash_table {
+	uint32_t seed;					/* hash seed */
+	unsigned mask;					/* number of slots - 1 */
+	unsigned count;					/* number of keys */
+	const signed char *slot;		/* key index for each slot, -1 if empty */
+	const char * const *key;		/* keys */
+	const unsigned char *keyLen;	/* key lengths */
+	const char * const *value;		/* values, NULL if the table has none */
+};
+
+/* Prototypes. */
+uint32_t perfhash_hash(uint32_t seed, const char *s, unsigned len);
+int perfhash_lookup(const perfhashTable_t *t, const char *s, unsigned len);
+
+#endif
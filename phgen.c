@@ -0,0 +1,263 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* phgen.c
+*
+* Perfect hash table generator, run at build time.
+*
+* Usage: phgen file.def base
+*
+* Reads the table definitions in file.def and writes base.h and base.c. For each table, the smallest
+* power of two slot count (up to MAX_SCALE times the key count) and the first seed which give every
+* key its own slot are used.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "perfhash.h"
+
+#define MAX_LINE 256
+#define MAX_TABLES 16
+#define MAX_KEYS 127
+#define MAX_NAME 64
+#define MAX_SCALE 8
+#define MAX_SEED 1000000
+
+typedef struct {
+	char name[MAX_NAME];
+	char prefix[MAX_NAME];
+	unsigned count;
+	int hasValues;
+	char *key[MAX_KEYS];
+	char *value[MAX_KEYS];
+	uint32_t seed;
+	unsigned size;
+	signed char slot[MAX_KEYS * MAX_SCALE * 2];
+} phTable_t;
+
+static phTable_t tables[MAX_TABLES];
+static unsigned tableCount = 0;
+static const char *progName;
+
+
+/*
+* Print an error and quit
+*/
+
+static void die(const char *file, unsigned line, const char *msg)
+{
+	if(line)
+		fprintf(stderr, "%s: %s line %u: %s\n", progName, file, line, msg);
+	else
+		fprintf(stderr, "%s: %s: %s\n", progName, file, msg);
+	exit(1);
+}
+
+/*
+* Read the table definitions
+*/
+
+static void readDefs(const char *file)
+{
+	char line[MAX_LINE], a[MAX_LINE], b[MAX_LINE], c[MAX_LINE];
+	phTable_t *t = NULL;
+	unsigned lineNum = 0;
+	int n;
+	FILE *f;
+
+	if(!(f = fopen(file, "r")))
+		die(file, 0, "can't open");
+
+	while(fgets(line, sizeof(line), f)){
+		lineNum++;
+		if((n = sscanf(line, "%255s %255s %255s", a, b, c)) < 1 || (a[0] == '#'))
+			continue;
+
+		if(!strcmp(a, "table")){
+			if(n != 3)
+				die(file, lineNum, "table needs a name and a prefix");
+			if(tableCount >= MAX_TABLES)
+				die(file, lineNum, "too many tables");
+			if((strlen(b) >= MAX_NAME) || (strlen(c) >= MAX_NAME))
+				die(file, lineNum, "name too long");
+			t = &tables[tableCount++];
+			strcpy(t->name, b);
+			strcpy(t->prefix, c);
+			continue;
+		}
+
+		if(!t)
+			die(file, lineNum, "key outside of a table");
+		if(t->count >= MAX_KEYS)
+			die(file, lineNum, "too many keys");
+		if(strlen(a) > 255)
+			die(file, lineNum, "key too long");
+		if(!(t->key[t->count] = strdup(a)))
+			die(file, lineNum, "out of memory");
+		if(n > 1){
+			if(!(t->value[t->count] = strdup(b)))
+				die(file, lineNum, "out of memory");
+			t->hasValues = 1;
+		}
+		t->count++;
+	}
+	fclose(f);
+}
+
+/*
+* Find a seed and slot count which give each key its own slot
+*/
+
+static void solve(phTable_t *t)
+{
+	unsigned size, i, s;
+	uint32_t seed;
+
+	for(size = 1; size < t->count; size <<= 1);
+
+	for(; size <= t->count * MAX_SCALE; size <<= 1){
+		for(seed = 1; seed < MAX_SEED; seed++){
+			memset(t->slot, -1, size);
+			for(i = 0; i < t->count; i++){
+				s = perfhash_hash(seed, t->key[i], strlen(t->key[i])) & (size - 1);
+				if(t->slot[s] >= 0)
+					break;
+				t->slot[s] = i;
+			}
+			if(i == t->count){
+				t->seed = seed;
+				t->size = size;
+				return;
+			}
+		}
+	}
+	die(t->name, 0, "no perfect hash found");
+}
+
+/*
+* Write the identifier for a key
+*/
+
+static void putIdent(FILE *f, const char *prefix, const char *key)
+{
+	fprintf(f, "%s_", prefix);
+	for(; *key; key++)
+		fputc(isalnum((unsigned char) *key) ? toupper((unsigned char) *key) : '_', f);
+}
+
+/*
+* Write the header
+*/
+
+static void writeHeader(FILE *f, const char *def)
+{
+	phTable_t *t;
+	unsigned i;
+
+	fprintf(f, "/* Generated by phgen from %s, do not edit */\n\n", def);
+	fprintf(f, "#ifndef DISPATCH_TABLES_H\n#define DISPATCH_TABLES_H\n\n#include \"perfhash.h\"\n");
+	for(t = tables; t < tables + tableCount; t++){
+		fprintf(f, "\n/* %s: %u keys in %u slots, seed %u */\n\n", t->name, t->count, t->size, t->seed);
+		for(i = 0; i < t->count; i++){
+			fprintf(f, "#define ");
+			putIdent(f, t->prefix, t->key[i]);
+			fprintf(f, " %u\n", i);
+		}
+		fprintf(f, "#define %s_COUNT %u\n\n", t->prefix, t->count);
+		fprintf(f, "extern const perfhashTable_t %sTable;\n", t->name);
+	}
+	fprintf(f, "\n#endif\n");
+}
+
+/*
+* Write the tables
+*/
+
+static void writeTables(FILE *f, const char *def, const char *base)
+{
+	phTable_t *t;
+	unsigned i;
+
+	fprintf(f, "/* Generated by phgen from %s, do not edit */\n\n", def);
+	fprintf(f, "#include \"%s.h\"\n", base);
+	for(t = tables; t < tables + tableCount; t++){
+		fprintf(f, "\nstatic const char * const %sKeys[] = {\n", t->name);
+		for(i = 0; i < t->count; i++)
+			fprintf(f, "\t\"%s\",\n", t->key[i]);
+		fprintf(f, "};\n\nstatic const unsigned char %sKeyLen[] = {\n", t->name);
+		for(i = 0; i < t->count; i++)
+			fprintf(f, "\t%u,\n", (unsigned) strlen(t->key[i]));
+		fprintf(f, "};\n\n");
+		if(t->hasValues){
+			fprintf(f, "static const char * const %sValues[] = {\n", t->name);
+			for(i = 0; i < t->count; i++){
+				if(t->value[i])
+					fprintf(f, "\t\"%s\",\n", t->value[i]);
+				else
+					fprintf(f, "\tNULL,\n");
+			}
+			fprintf(f, "};\n\n");
+		}
+		fprintf(f, "static const signed char %sSlots[] = {\n", t->name);
+		for(i = 0; i < t->size; i++)
+			fprintf(f, "\t%d,\n", t->slot[i]);
+		fprintf(f, "};\n\n");
+		fprintf(f, "const perfhashTable_t %sTable = { %uU, %u, %u, %sSlots, %sKeys, %sKeyLen, ",
+		t->name, t->seed, t->size - 1, t->count, t->name, t->name, t->name);
+		if(t->hasValues)
+			fprintf(f, "%sValues };\n", t->name);
+		else
+			fprintf(f, "NULL };\n");
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	char path[MAX_LINE];
+	FILE *f;
+	unsigned i;
+
+	progName = argv[0];
+	if(argc != 3){
+		fprintf(stderr, "Usage: %s file.def base\n", progName);
+		exit(1);
+	}
+	if(strlen(argv[2]) > MAX_LINE - 3)
+		die(argv[2], 0, "name too long");
+
+	readDefs(argv[1]);
+	for(i = 0; i < tableCount; i++)
+		solve(&tables[i]);
+
+	snprintf(path, sizeof(path), "%s.h", argv[2]);
+	if(!(f = fopen(path, "w")))
+		die(path, 0, "can't create");
+	writeHeader(f, argv[1]);
+	fclose(f);
+
+	snprintf(path, sizeof(path), "%s.c", argv[2]);
+	if(!(f = fopen(path, "w")))
+		die(path, 0, "can't create");
+	writeTables(f, argv[1], argv[2]);
+	fclose(f);
+
+	return 0;
+}
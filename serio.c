@@ -46,6 +46,15 @@
 #define ERROR -1
 
 #define SERIO_MAGIC	0x4C9A8DBF
+#define RING_MASK	(SERIO_RING_SIZE - 1)
+
+/*
+* The receive side may run on a different thread than the transmit side and the stats reader.
+* Its counters and the EOF flag are updated and read atomically, everything else belongs to one side.
+*/
+
+#define RX_COUNT(s, field)	__atomic_fetch_add(&(s)->stats.field, 1, __ATOMIC_RELAXED)
+#define RX_LOAD(s, field)	__atomic_load_n(&(s)->stats.field, __ATOMIC_RELAXED)
 
 enum {MS_OK, MS_FAULT};
 
@@ -59,6 +68,12 @@ static void free_seriostuff(serioStuffPtr_t serio)
 		if(serio->line)
 			free(serio->line);
 
+		if(serio->ring)
+			free(serio->ring);
+
+		if(serio->tx)
+			free(serio->tx);
+
 		if(serio->path)
 			free(serio->path);
 		serio->magic = 0;
@@ -195,25 +210,14 @@ Bool serio_check_node(char *path)
 
 
 
-/* 
- * Open the serial device. 
- *
- * Description of how to do the serial handling came from some mini serial
- * port programming howto.
- */
-
-
+/*
+* Private function to allocate a seriostuff_t type with its buffers
+*/
 
-serioStuffPtr_t serio_open(const char *tty_name, unsigned baudrate) {
+static serioStuffPtr_t new_seriostuff(const char *tty_name)
+{
 	serioStuffPtr_t serio;
-	speed_t brc;
-
 
-	if(!(brc = serio_get_baud(baudrate))){
-		debug(DEBUG_UNEXPECTED, "Invalid baud rate: %u\n", baudrate);
-		return NULL;
-	}
-	
 	/* Allocate memory for our struct */
 	if(!(serio = malloc(sizeof(serioStuff_t))))
 		return NULL;
@@ -230,13 +234,46 @@ serioStuffPtr_t serio_open(const char *tty_name, unsigned baudrate) {
 		free_seriostuff(serio);
 		return NULL;
 	}
+	/* Allocate memory for the receive ring */
+	if(!(serio->ring = malloc(SERIO_RING_SIZE))){
+		free_seriostuff(serio);
+		return NULL;
+	}
+	/* Allocate memory for the transmit queue */
+	if(!(serio->tx = malloc(SERIO_TX_SIZE))){
+		free_seriostuff(serio);
+		return NULL;
+	}
 	/* Duplicate path name */
 	if(!(serio->path = strdup(tty_name))){
 		free_seriostuff(serio);
 		return NULL;
 	}
+	return serio;
+}
+
+/* 
+ * Open the serial device. 
+ *
+ * Description of how to do the serial handling came from some mini serial
+ * port programming howto.
+ */
 
 
+
+serioStuffPtr_t serio_open(const char *tty_name, unsigned baudrate) {
+	serioStuffPtr_t serio;
+	speed_t brc;
+
+
+	if(!(brc = serio_get_baud(baudrate))){
+		debug(DEBUG_UNEXPECTED, "Invalid baud rate: %u\n", baudrate);
+		return NULL;
+	}
+
+	if(!(serio = new_seriostuff(tty_name)))
+		return NULL;
+
 	serio->brc = (unsigned ) brc;
 
 	/* Make sure the path is valid */
@@ -258,6 +295,21 @@ serioStuffPtr_t serio_open(const char *tty_name, unsigned baudrate) {
 }
 
 
+/*
+* Wrap an already open, non-blocking file descriptor (e.g. a pipe used for replay).
+* No terminal settings are changed. serio_close() will close the fd.
+*/
+
+serioStuffPtr_t serio_fdopen(int fd, const char *name)
+{
+	serioStuffPtr_t serio;
+
+	if(!(serio = new_seriostuff(name)))
+		return NULL;
+	serio->fd = fd;
+	return serio;
+}
+
 /*
 * Return the file descriptor
 */
@@ -275,8 +327,12 @@ int serio_fd(serioStuffPtr_t serio)
 int serio_flush_input(serioStuffPtr_t serio)
 {
 	int res = -1;
-	if(serio)
+	if(serio){
+		/* Discard anything buffered in the ring as well */
+		serio->head = serio->tail = serio->scan = 0;
+		serio->drained = FALSE;
 		res = tcflush(serio->fd, TCIFLUSH);
+	}
 	return res;
 }
 
@@ -316,7 +372,7 @@ int serio_read(serioStuffPtr_t serio, void *buffer, size_t count)
 	if(serio){
 		res = read(serio->fd, buffer, count);
 		if(res == 0){
-			serio->eof = TRUE;
+			__atomic_store_n(&serio->eof, TRUE, __ATOMIC_RELEASE);
 		}
 	}
 	return res;	
@@ -324,103 +380,212 @@ int serio_read(serioStuffPtr_t serio, void *buffer, size_t count)
 
 
 /*
-* Non blocking line read
-* Read bytes one at a time and build a line.
-* Return 1 if return detected or EOF , 0 if not at end of line, and -1 if error.
+* Private function to fill the receive ring with one large read.
+* Return the number of bytes read, 0 if nothing is available right now or the ring is full,
+* and -1 on EOF or error.
 */
 
-
-int serio_nb_line_read(serioStuffPtr_t serio)
+static int ring_fill(serioStuffPtr_t serio)
 {
-	char c;
+	unsigned used = serio->tail - serio->head;
+	unsigned space = SERIO_RING_SIZE - (serio->tail & RING_MASK);
 	int res;
-	
-	if(!serio)
+
+	/* Only read into the contiguous free space up to the end of the ring */
+	if(space > SERIO_RING_SIZE - used)
+		space = SERIO_RING_SIZE - used;
+	if(!space)
+		return 0;
+
+	res = serio_read(serio, serio->ring + (serio->tail & RING_MASK), space);
+	RX_COUNT(serio, reads);
+	if(serio->eof)
 		return -1;
+	if(res < 0){
+		if((errno != EAGAIN) && (errno != EWOULDBLOCK)){
+			debug(DEBUG_UNEXPECTED, "Read error on fd %d: %s", serio->fd, strerror(errno));
+			serio->head = serio->tail = serio->scan = 0;
+			return -1;
+		}
+		serio->drained = TRUE;
+		return 0;
+	}
+	if(serio->capture)
+		capture_write(serio->capture, serio->ring + (serio->tail & RING_MASK), res);
+	/* A short read means the fd has been emptied */
+	if(res < space)
+		serio->drained = TRUE;
+	serio->tail += res;
+	return res;
+}
 
+/*
+* Private function to find the next line in the receive ring.
+* The fd is only read when the ring holds no complete line, and then in as large a chunk as will fit.
+* On success, the line runs from serio->head up to the terminator at serio->scan.
+* Return 1 if a line was found or EOF, 0 if there is no complete line yet, and -1 if error.
+*/
 
+static int ring_find(serioStuffPtr_t serio, char term)
+{
 	do{
-		res = serio_read(serio, &c, 1);	
-		if(serio->eof){
-			return TRUE;
+		/* Look for the line terminator in what has been buffered so far */
+		for(; serio->scan != serio->tail; serio->scan++){
+			if(serio->ring[serio->scan & RING_MASK] == term)
+				return TRUE;
+		}
+		if(serio->tail - serio->head == SERIO_RING_SIZE){
+			/* Ring full without a terminator, discard the garbage */
+			debug(DEBUG_UNEXPECTED,"Receive ring full without a line terminator, discarding");
+			serio->head = serio->tail = serio->scan = 0;
 		}
-		if(res < 0){
-			if((errno != EAGAIN) && (errno != EWOULDBLOCK)){
-				debug(DEBUG_UNEXPECTED, "Read error on fd %d: %s", serio->fd, strerror(errno));
-				serio->pos = 0;
-				return ERROR;
-			}
+		/* Fd already emptied during this wakeup, don't waste a syscall finding out again */
+		if(serio->drained){
+			serio->drained = FALSE;
 			return FALSE;
 		}
-		else if(res == 1){
-			/* debug(DEBUG_ACTION,"Byte received"); */
-			if(c != '\r'){
-				if(serio->pos < (SERIO_MAX_LINE - 1))
-					serio->line[serio->pos++] = c;
-				else
-					debug(DEBUG_UNEXPECTED,"End of line buffer reached!");
-			}
-			else{
-				debug(DEBUG_ACTION, "Line received");
-				serio->line[serio->pos] = 0;
-				serio->pos = 0;
-				return TRUE;
-			}
+		switch(ring_fill(serio)){
+			case -1:
+				return serio->eof ? TRUE : ERROR;
+			case 0:
+				if(serio->drained){
+					serio->drained = FALSE;
+					return FALSE;
+				}
+				break;
+			default:
+				break;
 		}
 	} while(TRUE);
 
 	return ERROR;
 }
 
+/*
+* Private function to release the line found by ring_find()
+*/
+
+static void ring_consume(serioStuffPtr_t serio)
+{
+	serio->head = serio->scan = serio->scan + 1;
+	/* Rewind an empty ring so the next lines stay contiguous */
+	if(serio->head == serio->tail)
+		serio->head = serio->tail = serio->scan = 0;
+	RX_COUNT(serio, lines);
+	debug(DEBUG_ACTION, "Line received");
+}
+
+/*
+* Private function to copy the next line out of the receive ring into the line buffer.
+* Return 1 if a line was found or EOF, 0 if there is no complete line yet, and -1 if error.
+*/
+
+static int ring_line(serioStuffPtr_t serio, char term, Bool ignorecr)
+{
+	unsigned i;
+	int pos, res;
+	char c;
+
+	if(!serio)
+		return ERROR;
+
+	if(((res = ring_find(serio, term)) != TRUE) || serio->eof)
+		return res;
+
+	/* Copy the line out of the ring */
+	for(i = serio->head, pos = 0; i != serio->scan; i++){
+		c = serio->ring[i & RING_MASK];
+		if(ignorecr && (c == '\r')) /* Ignore return */
+			continue;
+		if(pos < (SERIO_MAX_LINE - 1))
+			serio->line[pos++] = c;
+	}
+	if(pos == (SERIO_MAX_LINE - 1))
+		debug(DEBUG_UNEXPECTED,"End of line buffer reached!");
+	serio->line[pos] = 0;
+	ring_consume(serio);
+	return TRUE;
+}
+
 /*
 * Non blocking line read
-* Read bytes one at a time and build a line.
+* Drain the fd into the receive ring and return the next line terminated by a return.
+* Call repeatedly until 0 is returned to get every line received in a wakeup.
+* Return 1 if return detected or EOF , 0 if not at end of line, and -1 if error.
+*/
+
+
+int serio_nb_line_read(serioStuffPtr_t serio)
+{
+	return ring_line(serio, '\r', FALSE);
+}
+
+/*
+* Non blocking line read
+* Drain the fd into the receive ring and return the next line terminated by a new line.
+* Returns are ignored. Call repeatedly until 0 is returned to get every line received in a wakeup.
 * Return 1 on cr detected or EOF, 0 if not at end of line, and -1 if error.
 */
 
 
 int serio_nb_line_readcr(serioStuffPtr_t serio)
 {
-	char c;
+	return ring_line(serio, '\n', TRUE);
+}
+
+/*
+* Non blocking line read without copying
+* Like serio_nb_line_readcr(), but the view is pointed straight into the receive ring.
+* The line is NUL terminated in place, and a trailing return is stripped.
+* Only a line which wraps around the end of the ring gets copied into the line buffer.
+* The view is valid until the next read function call on this port.
+* Return 1 on a line or EOF (len set to 0), 0 if not at end of line, and -1 if error.
+*/
+
+int serio_nb_line_view(serioStuffPtr_t serio, serioView_t *view)
+{
+	unsigned start, len, first;
 	int res;
-	
-	if(!serio)
-		return -1;
+	char *text;
 
-	do{
-		res = serio_read(serio, &c, 1);	
-		if(serio->eof){
-			return TRUE;
-		}
-		else if(res < 0){	
-			if((errno != EAGAIN) && (errno != EWOULDBLOCK)){
-				debug(DEBUG_UNEXPECTED, "Read error on fd %d: %s", serio->fd, strerror(errno));
-				serio->pos = 0;
-				return ERROR;
-			}
-			return FALSE;
-		}
-		else if(res == 1){
-			/* debug(DEBUG_ACTION,"Byte received"); */
-			if(c == '\r') /* Ignore return */
-				continue;
-			if(c != '\n'){
-				if(serio->pos < (SERIO_MAX_LINE - 1))
-					serio->line[serio->pos++] = c;
-				else
-					debug(DEBUG_UNEXPECTED,"End of line buffer reached!");
-
-			}
-			else{
-				debug(DEBUG_ACTION, "Line received");
-				serio->line[serio->pos] = 0;
-				serio->pos = 0;
-				return TRUE;
-			}
+	if((!serio) || (!view))
+		return ERROR;
+
+	view->text = "";
+	view->len = 0;
+
+	if(((res = ring_find(serio, '\n')) != TRUE) || serio->eof)
+		return res;
+
+	start = serio->head & RING_MASK;
+	len = serio->scan - serio->head;
+
+	if(start + len < SERIO_RING_SIZE){
+		/* Contiguous, terminate the line on top of the new line */
+		text = serio->ring + start;
+	}
+	else{
+		/* Wrapped around the end of the ring, stitch it together in the line buffer */
+		if(len > SERIO_MAX_LINE - 1){
+			debug(DEBUG_UNEXPECTED,"End of line buffer reached!");
+			len = SERIO_MAX_LINE - 1;
 		}
-	} while(TRUE);
+		first = SERIO_RING_SIZE - start;
+		if(first > len)
+			first = len;
+		memcpy(serio->line, serio->ring + start, first);
+		memcpy(serio->line + first, serio->ring, len - first);
+		text = serio->line;
+		RX_COUNT(serio, wraps);
+	}
+	if(len && (text[len - 1] == '\r'))
+		len--;
+	text[len] = 0;
 
-	return ERROR;
+	view->text = text;
+	view->len = len;
+	ring_consume(serio);
+	return TRUE;
 }
 
 /*
@@ -431,7 +596,7 @@ Bool serio_ateof(serioStuffPtr_t serio)
 {
 	Bool res = TRUE;
 	if(serio)
-		res = serio->eof;
+		res = __atomic_load_n(&serio->eof, __ATOMIC_ACQUIRE);
 	return res;
 }
 
@@ -449,6 +614,9 @@ char *serio_line(serioStuffPtr_t serio)
 
 /*
 * Printf to the com port
+* The output is added to the transmit queue, and nothing is written until serio_tx_flush() is called.
+* Output from several calls is coalesced into one write.
+* Return the number of bytes queued, or -1 if the output will not fit in the queue.
 */
 
 
@@ -456,15 +624,117 @@ int serio_printf(serioStuffPtr_t serio, const char *format, ...)
 {
  	va_list ap;
 	int res = 0;
+	unsigned space;
     
 	va_start(ap, format);
 	
-	if(serio && (serio->eof == FALSE)){
-		if(serio->fd >= 0)
-			res = vdprintf(serio->fd, format, ap);
+	if(serio && (!serio_ateof(serio))){
+		space = SERIO_TX_SIZE - serio->txlen;
+		res = vsnprintf(serio->tx + serio->txlen, space, format, ap);
+		if((res < 0) || (res >= space)){
+			/* Don't queue a partial command */
+			debug(DEBUG_UNEXPECTED, "Transmit queue full on %s", serio->path);
+			serio->stats.txRejects++;
+			res = -1;
+		}
+		else if(res){
+			if(!serio->txlen)
+				serio->txsince = capture_now_us();
+			serio->txlen += res;
+			if(serio->txlen > serio->stats.txMaxDepth)
+				serio->stats.txMaxDepth = serio->txlen;
+		}
 	}
 	
 	va_end(ap);
 	return res;
 }
 
+/*
+* Write as much of the transmit queue as the port will take.
+* Call when the fd is writable. Short writes and EAGAIN leave the rest queued for next time.
+* Return the number of bytes still queued, or -1 on a write error. The queue is emptied on a write error.
+*/
+
+int serio_tx_flush(serioStuffPtr_t serio)
+{
+	int res;
+	uint64_t latency;
+
+	if(!serio)
+		return -1;
+
+	if(!serio->txlen)
+		return 0;
+
+	res = serio_write(serio, serio->tx, serio->txlen);
+	serio->stats.writes++;
+	if(res < 0){
+		if((errno != EAGAIN) && (errno != EWOULDBLOCK)){
+			/* Drop the queue, or the caller would keep polling for writable and fail again */
+			debug(DEBUG_UNEXPECTED, "Write error on fd %d: %s, %u bytes dropped", serio->fd, strerror(errno), serio->txlen);
+			serio->stats.txDropped += serio->txlen;
+			serio->txlen = 0;
+			return -1;
+		}
+		return serio->txlen;
+	}
+	if(res < serio->txlen){
+		memmove(serio->tx, serio->tx + res, serio->txlen - res);
+		serio->txlen -= res;
+		return serio->txlen;
+	}
+
+	/* Queue emptied */
+	serio->txlen = 0;
+	latency = capture_now_us() - serio->txsince;
+	serio->stats.txLatency = latency;
+	if(latency > serio->stats.txMaxLatency)
+		serio->stats.txMaxLatency = latency;
+	serio->stats.txDrains++;
+	return 0;
+}
+
+/*
+* Return the number of bytes waiting in the transmit queue
+*/
+
+unsigned serio_tx_pending(serioStuffPtr_t serio)
+{
+	unsigned res = 0;
+	if(serio)
+		res = serio->txlen;
+	return res;
+}
+
+/*
+* Return the performance counters
+*/
+
+void serio_get_stats(serioStuffPtr_t serio, serioStats_t *stats)
+{
+	if(serio && stats){
+		stats->reads = RX_LOAD(serio, reads);
+		stats->lines = RX_LOAD(serio, lines);
+		stats->wraps = RX_LOAD(serio, wraps);
+		stats->writes = serio->stats.writes;
+		stats->txDrains = serio->stats.txDrains;
+		stats->txRejects = serio->stats.txRejects;
+		stats->txDropped = serio->stats.txDropped;
+		stats->txDepth = serio->txlen;
+		stats->txMaxDepth = serio->stats.txMaxDepth;
+		stats->txLatency = serio->stats.txLatency;
+		stats->txMaxLatency = serio->stats.txMaxLatency;
+	}
+}
+
+/*
+* Record everything read from now on in a capture file. Pass NULL to stop.
+* The capture file is not closed by serio_close().
+*/
+
+void serio_set_capture(serioStuffPtr_t serio, capturePtr_t cap)
+{
+	if(serio)
+		serio->capture = cap;
+}
@@ -25,27 +25,64 @@
 #define SERIO_H
 
 #include "types.h"
+#include "capture.h"
 
 #define SERIO_MAX_LINE 1024
+#define SERIO_RING_SIZE 4096	/* Receive ring size, must be a power of 2 */
+#define SERIO_TX_SIZE 1024		/* Transmit queue size */
 
 
 /* Typedefs. */
 typedef struct seriostuff serioStuff_t;
 typedef serioStuff_t * serioStuffPtr_t;
 
+typedef struct serio_view serioView_t;
+typedef struct serio_stats serioStats_t;
+
+/* Pointer/length view of a received line. */
+struct serio_view {
+	const char *text;
+	unsigned len;
+};
+
+/* Performance counters. */
+struct serio_stats {
+	unsigned long reads;	/* read() syscalls issued */
+	unsigned long lines;	/* lines delivered */
+	unsigned long wraps;	/* lines copied because they wrapped around the ring */
+	unsigned long writes;	/* write() syscalls issued */
+	unsigned long txDrains;	/* times the transmit queue was emptied */
+	unsigned long txRejects;	/* printfs which didn't fit in the transmit queue */
+	unsigned long txDropped;	/* bytes dropped from the transmit queue after a write error */
+	unsigned txDepth;		/* bytes waiting in the transmit queue */
+	unsigned txMaxDepth;	/* most bytes ever waiting in the transmit queue */
+	uint64_t txLatency;		/* us from the oldest byte being queued to the queue emptying, last time */
+	uint64_t txMaxLatency;	/* worst transmit latency seen */
+};
+
 /* Structure to hold serio info. */
 struct seriostuff {
 	Bool eof;			/* EOF flag */
 	int fd;				/* File descriptor */
-	int pos;			/* Position variable for non-blocking read fn's */
 	unsigned brc;		/* baud rate constant */
 	unsigned magic;	/* magic number */
 	char *path;			/* path name to node file */
 	char *line;			/* line buffer for non-blocking read fn's */
+	char *ring;			/* receive ring buffer */
+	unsigned head;		/* ring consumer index (free running) */
+	unsigned tail;		/* ring producer index (free running) */
+	unsigned scan;		/* ring index where the line terminator search resumes */
+	Bool drained;		/* last read() came up short, fd is empty for this wakeup */
+	char *tx;			/* transmit queue */
+	unsigned txlen;		/* bytes waiting in the transmit queue */
+	uint64_t txsince;	/* monotonic us when the oldest byte in the transmit queue was queued */
+	serioStats_t stats;	/* performance counters */
+	capturePtr_t capture;	/* optional capture file for everything read */
 };
 
 /* Prototypes. */
 serioStuffPtr_t serio_open(const char *tty_name, unsigned baudrate);
+serioStuffPtr_t serio_fdopen(int fd, const char *name);
 void serio_close(serioStuffPtr_t serio);
 Bool serio_check_node(char *path);
 int serio_flush_input(serioStuffPtr_t serio);
@@ -55,8 +92,13 @@ int serio_write(serioStuffPtr_t serio, const void *buffer, size_t count);
 int serio_read(serioStuffPtr_t serio, void *buffer, size_t count);
 int serio_nb_line_read(serioStuffPtr_t serio);
 int serio_nb_line_readcr(serioStuffPtr_t serio);
+int serio_nb_line_view(serioStuffPtr_t serio, serioView_t *view);
 char *serio_line(serioStuffPtr_t serio);
 Bool serio_ateof(serioStuffPtr_t serio);
 int serio_printf(serioStuffPtr_t serio, const char *format, ...);
+void serio_set_capture(serioStuffPtr_t serio, capturePtr_t cap);
+int serio_tx_flush(serioStuffPtr_t serio);
+unsigned serio_tx_pending(serioStuffPtr_t serio);
+void serio_get_stats(serioStuffPtr_t serio, serioStats_t *stats);
 
 #endif
@@ -41,25 +41,86 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <xPL.h>
+#include "capture.h"
 #include "serio.h"
 #include "notify.h"
 #include "confread.h"
+#include "nodewatch.h"
+#include "keypad.h"
+#include "dispatch.h"
+#include "allocheck.h"
+#include "eventq.h"
+#include "ingest.h"
 
-#define SHORT_OPTIONS "c:d:f:hi:np:s:u:v"
+#define SHORT_OPTIONS "c:C:d:f:hi:np:R:s:u:vx:"
 
 
 #define WS_SIZE 256
-#define SERIAL_RETRY_TIME 5
+#define SERIAL_RETRY_MIN 1
+#define SERIAL_RETRY_MAX 30
+#define STATS_INTERVAL 300
+#define DEF_DUP_WINDOW 30
+#define DEF_COALESCE_WINDOW 0
+#define DEF_GATESTAT_HEARTBEAT 900
+#define DEF_REQUEST_WINDOW 250
+#define GATESTAT_NONE 0xFFFFFFFF
+#define COALESCE_MAX 32
+#define EVENT_BURST 8
+#define FAULT_ZONES 128
+#define FAULT_EXPIRE 30
+#define RFX_LOOPS 4
+#define RFX_HASH_BITS 6
+#define RFX_HASH_SIZE (1 << RFX_HASH_BITS)
+#define RFX_MAX_SERIAL 9999999
+
+#define ZONE_MAX_NUM 99
+#define ZONE_MAX_COUNT 128		/* zone map entries */
+#define ZONE_PAIRS_MAX 4
+#define ZONE_PART_OVERHEAD 32
+#define ZONE_BODY_MAX 1024
+/* Every part of a zone list holds at least one zone, so there are never more parts than zones */
+#define ZONE_PARTS_MAX ZONE_MAX_COUNT
+#define ZONE_HASH_BITS 8
+#define ZONE_HASH_SIZE (1 << ZONE_HASH_BITS)
+
+#if ZONE_HASH_SIZE < 2 * ZONE_MAX_COUNT
+#error "The zone name index must be at most half full"
+#endif
+
+#define EXP_MAX_ADDR 99
+#define EXP_MAX_CHANNEL 99
+#define REL_ADDRS 32
+#define REL_CHANNELS 4
+#define REL_UNKNOWN -1
+
+/* RFX status byte bits */
+#define RFX_LOW_BATTERY 0x02
+#define RFX_SUPERVISION 0x04
+#define MAX_DEVICES 16
 #define COM_BAUD_RATE 115200
 
 #define DEF_INSTANCE_ID		"ademco"
 #define DEF_COM_PORT		"/dev/tty-ademco"
 #define DEF_PID_FILE		"/var/run/xplademco.pid"
 #define DEF_CFG_FILE		"/etc/xplademco.conf"
+#define DEF_ZONE_MAP		"zone-map"
+#define DEF_EXP_MAP			"exp-map"
+#define DEF_RFX_MAP			"rfx-map"
+#define DEF_REL_MAP			"rel-map"
 
 #define MALLOC_ERROR	malloc_error(__FILE__,__LINE__)
 
+/* Status word bit for an alarm reported by the LRR, above the keypad status bits */
+#define STAT_LRR_ALARM	0x80000000
+
+#define STAT_ARMED_BITS	(KEYPAD_ARMED_AWAY | KEYPAD_ARMED_HOME | KEYPAD_ENTRY_DELAY_OFF | KEYPAD_PERIMETER_ONLY)
+#define STAT_ALARM_BITS	(KEYPAD_ALARM_BELL | KEYPAD_FIRE | STAT_LRR_ALARM)
+
 typedef struct state_bits stateBits_t;
 
 struct state_bits {
@@ -80,15 +141,20 @@ struct zone_map {
 	String zone_name;
 	String zone_type;
 	String alarm_type;
+	Bool alarmClass;
+	Bool flapping;
+	unsigned rateBurst;
+	unsigned ratePeriod;
+	uint64_t credit;
+	uint64_t creditTime;
+	String lastEvent;
+	String heldEvent;
+	xPL_MessagePtr flapMessage;
+	xPL_MessagePtr infoMessage;
 	zoneMapPtr_t next;
 	zoneMapPtr_t prev;
 };
 	
-typedef struct {
-	const String ademco;
-	const String xpl;
-} lrrNameMap_t;
-
 
 typedef struct exp_map expMap_t;
 typedef expMap_t * expMapPtr_t;
@@ -101,7 +167,148 @@ struct exp_map {
 	expMapPtr_t next;
 	expMapPtr_t prev;
 };
-	
+
+
+typedef struct rfx_sensor rfxSensor_t;
+typedef rfxSensor_t * rfxSensorPtr_t;
+
+/* A wireless sensor, kept in a hash table by serial number */
+
+struct rfx_sensor {
+	uint32_t serial;
+	unsigned status;
+	zoneMapPtr_t loop_zone[RFX_LOOPS];
+	rfxSensorPtr_t next;
+};
+
+
+typedef struct relay_state relayState_t;
+typedef relayState_t * relayStatePtr_t;
+
+/* A relay module output */
+
+struct relay_state {
+	String name;
+	int state;
+};
+
+
+typedef struct zone_parts zoneParts_t;
+typedef zoneParts_t * zonePartsPtr_t;
+
+/* A zone list response, split over as many messages as it takes */
+
+struct zone_parts {
+	unsigned count;
+	xPL_MessagePtr part[ZONE_PARTS_MAX];
+};
+
+
+typedef struct request_window requestWindow_t;
+typedef requestWindow_t * requestWindowPtr_t;
+
+/* Identical requests which are answered together */
+
+struct request_window {
+	uint64_t end;
+	unsigned waiting;
+};
+
+
+typedef struct coalesce_entry coalesceEntry_t;
+typedef coalesceEntry_t * coalesceEntryPtr_t;
+
+/* A zone transition held for the coalescing window */
+
+struct coalesce_entry {
+	xPL_MessagePtr msg;
+	String event;
+	zoneMapPtr_t zm;
+	unsigned num;
+};
+
+
+typedef struct ad_device adDevice_t;
+typedef adDevice_t * adDevicePtr_t;
+
+/* Everything belonging to one ad2usb */
+
+struct ad_device {
+	unsigned index;
+	unsigned serialRetryTimer;
+	unsigned serialRetryDelay;
+	unsigned zoneCount;
+	int nodeWatch;
+	int coalesceFD;
+	unsigned coalesceCount;
+	unsigned long coalesceSaved;
+	unsigned long coalesceDropped;
+	unsigned long eventOverflows;
+	unsigned long suppressed;
+	unsigned flappingCount;
+	unsigned gateStatSent;
+	unsigned gateStatTimer;
+	unsigned long outages;
+	uint64_t outageStart;
+	uint64_t reconnectLatency;
+	uint64_t maxReconnectLatency;
+	uint64_t maxIngestLatency;
+	Bool alarmLRR;
+	Bool statBitsSeen;
+	Bool readySent;
+	Bool txWatch;
+	stateBits_t stateBits;
+	uint32_t statWord;
+	char statBits[KEYPAD_BITS_LEN];
+	char display[KEYPAD_ALPHA_MAX + 1];
+	unsigned faultCount;
+	unsigned lastFault;
+	unsigned displayFault;
+	uint32_t faultBits[FAULT_ZONES / 32];
+	uint32_t faultSeen[FAULT_ZONES];
+	serioStuffPtr_t serio;
+	ingestPtr_t ingest;
+	capturePtr_t capture;
+	keypadCachePtr_t kpCache;
+	eventqPtr_t eventq;
+	xPL_ServicePtr service;
+	xPL_MessagePtr statusCache[RC_COUNT];
+	zoneParts_t zoneList;
+	zoneParts_t zoneInfo;
+	int requestFD;
+	unsigned maxServed;
+	unsigned long requests;
+	unsigned long replies;
+	requestWindow_t requestWindows[RC_COUNT];
+	uint32_t statusStale;
+	xPL_MessagePtr eventTriggerMessage;
+	xPL_MessagePtr zoneTriggerMessage;
+	xPL_MessagePtr relayTriggerMessage;
+	xPL_MessagePtr gateStatMessage;
+	zoneMapPtr_t zoneMapHead;
+	zoneMapPtr_t zoneMapTail;
+	zoneMapPtr_t zoneIndex[ZONE_MAX_NUM + 1];
+	zoneMapPtr_t zoneHash[ZONE_HASH_SIZE];
+	expMapPtr_t expMapHead;
+	expMapPtr_t expMapTail;
+	expMapPtr_t *expIndex[EXP_MAX_ADDR + 1];
+	rfxSensorPtr_t rfxHash[RFX_HASH_SIZE];
+	relayState_t relays[REL_ADDRS][REL_CHANNELS];
+	coalesceEntry_t coalesce[COALESCE_MAX];
+	char comPort[WS_SIZE];
+	char instanceID[WS_SIZE];
+};
+
+/* Status response builders */
+
+typedef void (*statusBuilder_t)(adDevicePtr_t dev, xPL_MessagePtr msg);
+
+/* Status bit change handlers */
+
+typedef struct {
+	uint32_t mask;
+	void (*handler)(adDevicePtr_t dev, uint32_t word);
+} statHandler_t;
 
 
 
@@ -112,23 +319,18 @@ enum { CO_PID_FILE = 1, CO_COM_PORT = 2, CO_INSTANCE_ID= 4, CO_INTERFACE = 8, CO
 char *progName;
 int debugLvl = 0; 
 static Bool noBackground = FALSE;
-static unsigned serialRetryTimer = 0;
 static uint32_t configOverride = 0;
-static unsigned zoneCount = 0;
-static Bool alarmLRR = FALSE;
-static stateBits_t stateBits = {0,0,0,0,0};
-
-static Bool lineReceived = FALSE;
-static serioStuffPtr_t serioStuff = NULL;
-static xPL_ServicePtr xplService = NULL;
-static xPL_MessagePtr xplStatusMessage = NULL;
-static xPL_MessagePtr xplEventTriggerMessage = NULL;
-static xPL_MessagePtr xplZoneTriggerMessage = NULL;
+static unsigned deviceCount = 0;
+static int nodeWatchFD = -1;
+static double replaySpeed = 1.0;
+static unsigned dupWindow = DEF_DUP_WINDOW;
+static unsigned coalesceWindow = DEF_COALESCE_WINDOW;
+static unsigned gateStatHeartbeat = DEF_GATESTAT_HEARTBEAT;
+static unsigned requestWindow = DEF_REQUEST_WINDOW;
+static unsigned serialThread = 0;
+
 static ConfigEntry_t *configEntry = NULL;
-static zoneMapPtr_t zoneMapHead = NULL;
-static zoneMapPtr_t zoneMapTail = NULL;
-static expMapPtr_t expMapHead = NULL;
-static expMapPtr_t expMapTail = NULL;
+static adDevicePtr_t devices[MAX_DEVICES];
 
 
 static char comPort[WS_SIZE] = DEF_COM_PORT;
@@ -137,32 +339,16 @@ static char debugFile[WS_SIZE] = "";
 static char instanceID[WS_SIZE] = DEF_INSTANCE_ID;
 static char pidFile[WS_SIZE] = DEF_PID_FILE;
 static char configFile[WS_SIZE] = DEF_CFG_FILE;
+static char captureFile[WS_SIZE] = "";
+static char replayFile[WS_SIZE] = "";
+static unsigned long replaySent = 0;
 
 
 
-/* Basic command list */
-
-static const String const basicCommandList[] = {
-	"arm-away",
-	"arm-home",
-	"disarm",
-	NULL
-};
-
-
-/* Request command list */
-
-static const String const requestCommandList[] = {
-	"gateinfo",
-	"zonelist",
-	"zoneinfo",
-	"gatestat",
-	NULL
-};
-
 /* Commandline options. */
 
 static struct option longOptions[] = {
+  {"capture", 1, 0, 'C'},
   {"com-port", 1, 0, 'p'},
   {"config",1, 0, 'c'},
   {"debug-level", 1, 0, 'd'},
@@ -172,29 +358,22 @@ static struct option longOptions[] = {
   {"debug-file", 1, 0, 'u'},
   {"no-background", 0, 0, 'n'},
   {"pid-file", 0, 0, 'f'},
+  {"replay", 1, 0, 'R'},
+  {"replay-speed", 1, 0, 'x'},
   {"version", 0, 0, 'v'},
   {0, 0, 0, 0}
 };
 
-/* Ad2usb to xPL event mapping */
-
-lrrNameMap_t lrrNameMap[] = {
-{"ACLOSS","ac-fail"},
-{"LOWBAT","low-battery"},
-{"OPEN","disarmed"},
-{"ARM_AWAY","armed"},
-{"ARM_STAY","armed-stay"},
-{"AC_RESTORE","ac-restore"},
-{"LOWBAT_RESTORE","battery-ok"},
-{"ALARM_PANIC","alarm"},
-{"ALARM_FIRE","alarm"},
-{"ALARM_ENTRY","alarm"},
-{"ALARM_AUX","alarm"},
-{"ALARM_AUDIBLE","alarm"},
-{"ALARM_SILENT","alarm"},
-{"ALARM_PERIMETER","alarm"},
-{NULL,NULL} };
+/* Forward declarations */
+
+static void serioHandler(int fd, int revents, int userValue);
+static void serialLost(adDevicePtr_t dev);
+static void sendZoneEvent(adDevicePtr_t dev, xPL_MessagePtr msg, zoneMapPtr_t zm, unsigned num, const String event);
+static void doRequest(adDevicePtr_t dev, int request);
+
+/* RFX status bit for each loop */
 
+static const unsigned rfxLoopBits[RFX_LOOPS] = { 0x80, 0x20, 0x10, 0x40 };
 
 /* 
  * Allocate a memory block and zero it out
@@ -310,55 +489,70 @@ static int pid_write(char *filename, pid_t pid) {
 
 static void shutdownHandler(int onSignal)
 {
-	xPL_setServiceEnabled(xplService, FALSE);
-	xPL_releaseService(xplService);
+	unsigned i;
+
+	for(i = 0; i < deviceCount; i++){
+		xPL_setServiceEnabled(devices[i]->service, FALSE);
+		xPL_releaseService(devices[i]->service);
+	}
 	xPL_shutdown();
-	unlink(pidFile);
+	if(!replayFile[0]) /* A replay doesn't own the pid file */
+		unlink(pidFile);
 	exit(0);
 }
 
 /*
-* Match a command from a NULL-terminated list, return index to list entry
+* Send an xPL message. A replay must not talk to the network, so there it is only counted.
 */
 
-static int matchCommand(const String const *commandList, const String const command)
+static Bool sendMessage(xPL_MessagePtr msg)
 {
-	int i;
-	
-	if((!command) || (!commandList))
-		return -1;
+	if(replayFile[0]){
+		replaySent++;
+		return TRUE;
+	}
+	return xPL_sendMessage(msg);
+}
 
-	for(i = 0; commandList[i]; i++){
-		if(!strcmp(command, commandList[i]))
-			break;
+/*
+* Find the device which owns an instance ID
+*/
+
+static adDevicePtr_t deviceLookup(const String iID)
+{
+	unsigned i;
+
+	if(!iID)
+		return NULL;
+
+	for(i = 0; i < deviceCount; i++){
+		if(!strcmp(devices[i]->instanceID, iID))
+			return devices[i];
 	}
-	return i;	
+	return NULL;
 }
 
 /*
-* Split string into pieces
-*
-* The string is copied, and the sep characters are replaced with nul's and a list pointers
-* is built. 
+* Split a string into pieces
 *
-* This function returns the number of arguments found.
+* The string is copied into the caller's buffer, the sep characters are replaced with nul's and a list of
+* pointers into the buffer is built. Nothing is allocated, and the list must have room for limit + 1 entries.
 *
-* When the caller is finished with the list and the return value is non-zero he should free() the first entry.
+* This function returns the number of arguments found, or 0 if the string does not fit in the buffer.
 */
 
-static int splitString(const String src, String *list, char sep, int limit)
+static int splitString(const String src, String buf, size_t size, String *list, char sep, int limit)
 {
-		String p, q, srcCopy;
+		String p, q;
 		int i;
 		
 
-		if((!src) || (!list) || (!limit))
+		if((!src) || (!buf) || (!list) || (!limit) || (strlen(src) >= size))
 			return 0;
 
-		if(!(srcCopy = strdup(src)))
-			MALLOC_ERROR;
+		strcpy(buf, src);
 
-		for(i = 0, q = srcCopy; (i < limit) && (p = strchr(q, sep)); i++, q = p + 1){
+		for(i = 0, q = buf; (i < limit) && (p = strchr(q, sep)); i++, q = p + 1){
 			*p = 0;
 			list[i] = q;
 		
@@ -370,52 +564,134 @@ static int splitString(const String src, String *list, char sep, int limit)
 		return i;
 }
 
+/*
+* Strip the leading and trailing blanks from a string in place, and return the start of what is left
+*/
+
+static String trimBlanks(String s)
+{
+	String end;
+
+	while((*s == ' ') || (*s == '\t'))
+		s++;
+	for(end = s + strlen(s); (end > s) && ((end[-1] == ' ') || (end[-1] == '\t')); end--);
+	*end = 0;
+	return s;
+}
+
+/*
+* Split a line view into pieces
+*
+* Works like splitString(), but nothing is copied. Each list entry is a view into the source.
+* The list must have room for limit + 1 entries.
+*
+* This function returns the number of arguments found.
+*/
+
+static int splitView(const serioView_t *src, serioView_t *list, char sep, int limit)
+{
+		const char *q, *p, *end;
+		int i;
+
+		if((!src) || (!list) || (!limit))
+			return 0;
+
+		end = src->text + src->len;
+		for(i = 0, q = src->text; (i < limit) && (p = memchr(q, sep, end - q)); i++, q = p + 1){
+			list[i].text = q;
+			list[i].len = p - q;
+		}
+		if(i){ /* If at least 1 separator is found, get the last bit */
+			list[i].text = q;
+			list[i].len = end - q;
+			i++;
+		}
+		return i;
+}
+
+/*
+* Convert the leading decimal digits in a view to an unsigned int
+*/
+
+static unsigned viewToUns(const serioView_t *v)
+{
+	unsigned i, res = 0;
+
+	for(i = 0; (i < v->len) && isdigit((unsigned char) v->text[i]); i++)
+		res = (res * 10) + (v->text[i] - '0');
+	return res;
+}
+
 /*
  * Do a zone lookup
  */
  
-zoneMapPtr_t zoneLookup(String s)
+zoneMapPtr_t zoneLookup(adDevicePtr_t dev, String s)
 {
 		uint32_t hash = confreadHash(s);
-		zoneMapPtr_t zm = zoneMapHead;
-		for(; zm; zm = zm->next){
+		unsigned i = hash & (ZONE_HASH_SIZE - 1);
+		zoneMapPtr_t zm;
+
+		/* Linear probe until a match or an empty slot */
+		for(; (zm = dev->zoneHash[i]); i = (i + 1) & (ZONE_HASH_SIZE - 1)){
 			if((zm->zone_name_hash == hash) && (!strcmp(s, zm->zone_name)))
 				break;
 		}
 		return zm;
 }
 
+/*
+* Find a zone by zone number
+*/
+
+static zoneMapPtr_t zoneNumLookup(adDevicePtr_t dev, unsigned num)
+{
+	return (num <= ZONE_MAX_NUM) ? dev->zoneIndex[num] : NULL;
+}
 
 /*
-* Return Gateway info 
+* Add a zone to the name and number indexes. The first entry for a name or number wins.
 */
 
-static void doGateInfo()
+static void zoneIndexAdd(adDevicePtr_t dev, zoneMapPtr_t zm)
 {
-	int i;
-	String ws;
-	
-	if(!(ws = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
-	
-	
+	unsigned i = zm->zone_name_hash & (ZONE_HASH_SIZE - 1);
+
+	if(!dev->zoneIndex[zm->zone_num])
+		dev->zoneIndex[zm->zone_num] = zm;
 
-	xPL_setSchema(xplStatusMessage, "security", "gateinfo");
+	for(; dev->zoneHash[i]; i = (i + 1) & (ZONE_HASH_SIZE - 1)){
+		if((dev->zoneHash[i]->zone_name_hash == zm->zone_name_hash) &&
+		(!strcmp(dev->zoneHash[i]->zone_name, zm->zone_name)))
+			return;
+	}
+	dev->zoneHash[i] = zm;
+}
 
-	xPL_clearMessageNamedValues(xplStatusMessage);
 
-	xPL_setMessageNamedValue(xplStatusMessage, "protocol", "ECP");
-	xPL_setMessageNamedValue(xplStatusMessage, "description", "ad2usb to xPL bridge");
-	xPL_setMessageNamedValue(xplStatusMessage, "version", VERSION);
-	xPL_setMessageNamedValue(xplStatusMessage, "author", "Stephen A. Rodgers");
-	xPL_setMessageNamedValue(xplStatusMessage, "info-url", "http://xpl.ohnosec.org");
-	snprintf(ws, WS_SIZE, "%u", zoneCount);
-	xPL_setMessageNamedValue(xplStatusMessage, "zone-count", ws);
+/*
+* Build the Gateway info response
+*/
+
+static void buildGateInfo(adDevicePtr_t dev, xPL_MessagePtr msg)
+{
+	int i;
+	char ws[WS_SIZE];
+	
+	xPL_clearMessageNamedValues(msg);
+
+	xPL_setMessageNamedValue(msg, "protocol", "ECP");
+	xPL_setMessageNamedValue(msg, "description", "ad2usb to xPL bridge");
+	xPL_setMessageNamedValue(msg, "version", VERSION);
+	xPL_setMessageNamedValue(msg, "author", "Stephen A. Rodgers");
+	xPL_setMessageNamedValue(msg, "info-url", "http://xpl.ohnosec.org");
+	snprintf(ws, WS_SIZE, "%u", dev->zoneCount);
+	xPL_setMessageNamedValue(msg, "zone-count", ws);
 	
 	/* Build comma delimited command list */
 	ws[0] = 0;
-	for(i = 0; basicCommandList[i] && (strlen(ws) + strlen(basicCommandList[i]) < WS_SIZE) ; i++){
-			strcat(ws, basicCommandList[i]);
+	for(i = 0; (i < BC_COUNT) && (strlen(ws) + strlen(basicCommandTable.key[i]) < WS_SIZE) ; i++){
+			strcat(ws, basicCommandTable.key[i]);
 			strcat(ws, ",");
 	}
 	/* Strip comma from end of string if it is there */
@@ -425,353 +701,1476 @@ static void doGateInfo()
 	if(ws[i] == ',')
 		ws[i] = 0;
 		
-	xPL_setMessageNamedValue(xplStatusMessage, "gateway-commands", ws);
+	xPL_setMessageNamedValue(msg, "gateway-commands", ws);
+}
 
-	if(!xPL_sendMessage(xplStatusMessage))
-		debug(DEBUG_UNEXPECTED, "request.gateinfo transmission failed");
-	free(ws);
-	
+/*
+* Get the name-value pairs which describe a zone in a zone list, or in a zone info list.
+* Return the number of pairs.
+*/
+
+static unsigned zonePairs(zoneMapPtr_t zm, Bool info, String *names, String *values)
+{
+	names[0] = info ? "id" : "zone-list";
+	values[0] = zm->zone_name;
+	if(!info)
+		return 1;
+	names[1] = "zone-type";
+	values[1] = zm->zone_type;
+	names[2] = "alarm-type";
+	values[2] = zm->alarm_type;
+	names[3] = "area-count";
+	values[3] = "0";
+	return ZONE_PAIRS_MAX;
 }
 
 /*
-* Return list of zones, one per name-value pair
+* Build a zone list, or a zone info list, split into as few messages as will keep each message body under
+* ZONE_BODY_MAX bytes. Each message starts with part and total name-value pairs.
+* The zone map doesn't change once the config is read, so this is done once.
 */
 
-static void doZoneList()
+static void buildZoneParts(adDevicePtr_t dev, zonePartsPtr_t zp, const String type, Bool info)
 {
-	zoneMapPtr_t zm;
+	zoneMapPtr_t zm, start[ZONE_PARTS_MAX + 1];
+	String names[ZONE_PAIRS_MAX], values[ZONE_PAIRS_MAX];
+	unsigned i, j, n, size = 0, len;
+	char ws[12];
+
+	/* Find the first zone in each part */
+	for(zp->count = 0, zm = dev->zoneMapHead; zm; zm = zm->next){
+		n = zonePairs(zm, info, names, values);
+		for(j = 0, len = 0; j < n; j++)
+			len += strlen(names[j]) + strlen(values[j]) + 2;
+		if((!zp->count) || (size + len > ZONE_BODY_MAX)){
+			start[zp->count++] = zm;
+			size = ZONE_PART_OVERHEAD;
+		}
+		size += len;
+	}
+	start[zp->count] = NULL;
+
+	/* Build the messages */
+	for(i = 0; i < zp->count; i++){
+		if(!(zp->part[i] = xPL_createBroadcastMessage(dev->service, xPL_MESSAGE_STATUS)))
+			fatal("Could not initialize security.%s response", type);
+		xPL_setSchema(zp->part[i], "security", type);
+		snprintf(ws, sizeof(ws), "%u", i + 1);
+		xPL_addMessageNamedValue(zp->part[i], "part", ws);
+		snprintf(ws, sizeof(ws), "%u", zp->count);
+		xPL_addMessageNamedValue(zp->part[i], "total", ws);
+		for(zm = start[i]; zm != start[i + 1]; zm = zm->next){
+			n = zonePairs(zm, info, names, values);
+			for(j = 0; j < n; j++)
+				xPL_addMessageNamedValue(zp->part[i], names[j], values[j]);
+		}
+	}
+	debug(DEBUG_ACTION, "%s: Built %s response in %u parts", dev->instanceID, type, zp->count);
+}
 
-	xPL_setSchema(xplStatusMessage, "security", "zonelist");
+/*
+* Send a zone list, or a zone info list
+*/
 
-	xPL_clearMessageNamedValues(xplStatusMessage);
+static void sendZoneParts(adDevicePtr_t dev, zonePartsPtr_t zp, const String type, Bool info)
+{
+	unsigned i;
 
-	for(zm = zoneMapHead; zm; zm = zm->next){
-		xPL_addMessageNamedValue(xplStatusMessage, "zone-list", zm->zone_name);
+	if(!zp->count)
+		buildZoneParts(dev, zp, type, info);
+	for(i = 0; i < zp->count; i++){
+		if(!sendMessage(zp->part[i]))
+			debug(DEBUG_UNEXPECTED, "request.%s transmission failed", type);
 	}
-	if(!xPL_sendMessage(xplStatusMessage))
-		debug(DEBUG_UNEXPECTED, "request.zonelist transmission failed");
 }
 
 
 /*
- * Return zone info for a specific zone
+ * Return zone info for a specific zone. The response is built the first time the zone is asked for, and kept.
+ * zone=* returns the info for every zone.
  */
 
-static void doZoneInfo(xPL_MessagePtr theMessage)
+static void doZoneInfo(adDevicePtr_t dev, xPL_MessagePtr theMessage)
 {
 		const String zone = xPL_getMessageNamedValue(theMessage, "zone");
 		zoneMapPtr_t zm;
-		if(zone && (zm = zoneLookup(zone))){
-			xPL_setSchema(xplStatusMessage, "security", "zoneinfo");
-			
-			/* Clear the message */
-			xPL_clearMessageNamedValues(xplStatusMessage);
+		if(zone && (!strcmp(zone, "*")))
+			doRequest(dev, RC_ZONEINFO);
+		else if(zone && (zm = zoneLookup(dev, zone))){
+			if(!zm->infoMessage){
+				if(!(zm->infoMessage = xPL_createBroadcastMessage(dev->service, xPL_MESSAGE_STATUS))){
+					debug(DEBUG_UNEXPECTED, "Could not create zoneinfo message");
+					return;
+				}
+				xPL_setSchema(zm->infoMessage, "security", "zoneinfo");
 			
-			/* Fill in the data */
-			xPL_addMessageNamedValue(xplStatusMessage, "id", zone);
-			xPL_addMessageNamedValue(xplStatusMessage, "zone-type", zm->zone_type);
-			xPL_addMessageNamedValue(xplStatusMessage, "alarm-type", zm->alarm_type);
-			xPL_addMessageNamedValue(xplStatusMessage, "area-count","0");
+				/* Fill in the data */
+				xPL_addMessageNamedValue(zm->infoMessage, "id", zm->zone_name);
+				xPL_addMessageNamedValue(zm->infoMessage, "zone-type", zm->zone_type);
+				xPL_addMessageNamedValue(zm->infoMessage, "alarm-type", zm->alarm_type);
+				xPL_addMessageNamedValue(zm->infoMessage, "area-count","0");
+			}
 			/* Send the message */
-			if(!xPL_sendMessage(xplStatusMessage))
+			if(!sendMessage(zm->infoMessage))
 				debug(DEBUG_UNEXPECTED, "request.zoneinfo transmission failed");
 		}
 }
 
 /*
- * Return gateway status
+ * Return the state bits which are reported in the gateway status, packed for comparison
  */
 
-static void doGateStat()
+static unsigned gateStatKey(adDevicePtr_t dev)
 {
-		String status = "disarmed";
-		
-		xPL_setSchema(xplStatusMessage, "security", "gatestat");
-		
-		/* Clear the message */
-		xPL_clearMessageNamedValues(xplStatusMessage);
-		
-		/* Fill in the data */
-		xPL_addMessageNamedValue(xplStatusMessage, "ac-fail", stateBits.acfail ? "true" : "false");
-		xPL_addMessageNamedValue(xplStatusMessage, "low-battery", stateBits.lowbatt ? "true" : "false");
-		if(stateBits.alarm)
-			status = "alarm";
-		else if(stateBits.armed)
-			status = "armed";
-		xPL_addMessageNamedValue(xplStatusMessage, "status", status);		
-		
-		/* Send the message */
-		if(!xPL_sendMessage(xplStatusMessage))
-			debug(DEBUG_UNEXPECTED, "request.gatestat transmission failed");
+	return (dev->stateBits.acfail) | (dev->stateBits.lowbatt << 1) | (dev->stateBits.armed << 2) | (dev->stateBits.alarm << 3);
 }
 
 /*
- * Arm or disarm the system
+ * Return the gateway status value
  */
- 
 
-void doArmDisarm(xPL_MessagePtr theMessage, int cmd)
+static String gateStatus(adDevicePtr_t dev)
 {
-	const String code = xPL_getMessageNamedValue(theMessage, "id");
-	
-	if(!code) /* If no code, then bail */
-		return;
-	
-	if(cmd < 2){
-		if(stateBits.ready){
-			serio_printf(serioStuff, "%s%c", code, (cmd == 0) ? '3' : '2');
-		}
-		else{ /* arming failed, send error trigger message */
-			xPL_clearMessageNamedValues(xplEventTriggerMessage);
-			xPL_addMessageNamedValue(xplEventTriggerMessage, "event", "error");
-			xPL_sendMessage(xplEventTriggerMessage);
-		}
-	}
-	else{ /* disarm */
-		serio_printf(serioStuff, "%s1", code);
-	}
+	if(dev->stateBits.alarm)
+		return "alarm";
+	if(dev->stateBits.armed)
+		return "armed";
+	return "disarmed";
 }
 
+/*
+ * Build the gateway status response
+ */
 
+static void buildGateStat(adDevicePtr_t dev, xPL_MessagePtr msg)
+{
+		/* Clear the message */
+		xPL_clearMessageNamedValues(msg);
+		
+		/* Fill in the data */
+		xPL_addMessageNamedValue(msg, "ac-fail", dev->stateBits.acfail ? "true" : "false");
+		xPL_addMessageNamedValue(msg, "low-battery", dev->stateBits.lowbatt ? "true" : "false");
+		xPL_addMessageNamedValue(msg, "status", gateStatus(dev));		
+}
 
 /*
-* Our Listener 
+* Return the name of a relay. Unmapped relays are named after their address and channel.
 */
 
+static String relayName(adDevicePtr_t dev, unsigned addr, unsigned channel, String ws, unsigned size)
+{
+	if(dev->relays[addr][channel - 1].name)
+		return dev->relays[addr][channel - 1].name;
+	snprintf(ws, size, "rel-%u-%u", addr, channel);
+	return ws;
+}
 
+/*
+ * Build the state of every known relay in one message
+ */
 
-static void xPLListener(xPL_MessagePtr theMessage, xPL_ObjectPtr userValue)
+static void buildRelayStat(adDevicePtr_t dev, xPL_MessagePtr msg)
 {
+	relayStatePtr_t rs;
+	unsigned addr, channel;
+	char ws[20];
+
+	/* Clear the message */
+	xPL_clearMessageNamedValues(msg);
+
+	/* One name-value pair per relay which is mapped or has reported */
+	for(addr = 0; addr < REL_ADDRS; addr++){
+		for(channel = 1; channel <= REL_CHANNELS; channel++){
+			rs = &dev->relays[addr][channel - 1];
+			if((!rs->name) && (rs->state == REL_UNKNOWN))
+				continue;
+			xPL_addMessageNamedValue(msg, relayName(dev, addr, channel, ws, sizeof(ws)),
+			(rs->state == REL_UNKNOWN) ? "unknown" : (rs->state ? "on" : "off"));
+		}
+	}
+}
 
-	if(!xPL_isBroadcastMessage(theMessage)){ /* If not a broadcast message */
-		if(xPL_MESSAGE_COMMAND == xPL_getMessageType(theMessage)){ /* If the message is a command */
-			const String iID = xPL_getTargetInstanceID(theMessage);
-			const String type = xPL_getSchemaType(theMessage);
-			const String class = xPL_getSchemaClass(theMessage);
-			const String command =  xPL_getMessageNamedValue(theMessage, "command");
-			const String request =  xPL_getMessageNamedValue(theMessage, "request");
-		
-				
-			debug(DEBUG_EXPECTED,"Non-broadcast message received: type=%s, class=%s", type, class);
-			
-			/* Allocate a working string */
-
+/*
+ * Build the outbound event queue status
+ */
 
-			if((!strcmp(instanceID, iID)) && (!strcmp(class, "security"))){
-				
-				if(!strcmp(type, "basic")){ /* Basic command schema */
-					if(command){
-						int index;
-						switch((index = matchCommand(basicCommandList, command))){
-							
-							case 0: /* arm-away */
-							case 1: /* arm-home */
-							case 2: /* disarm */
-								doArmDisarm(theMessage, index);
-								break;
-							
-							default:
-								break;
-						}
-					}
-				}
-				else if(!strcmp(type, "request")){ /* Request command schema */
-					if(request){
-						switch(matchCommand(requestCommandList, request)){
+static void buildQueueStat(adDevicePtr_t dev, xPL_MessagePtr msg)
+{
+	uint64_t oldest = eventq_oldest(dev->eventq);
+	char ws[24];
+
+	xPL_clearMessageNamedValues(msg);
+
+	snprintf(ws, sizeof(ws), "%u", eventq_depth(dev->eventq, EVENTQ_ALARM));
+	xPL_addMessageNamedValue(msg, "alarm-depth", ws);
+	snprintf(ws, sizeof(ws), "%u", eventq_depth(dev->eventq, EVENTQ_ROUTINE));
+	xPL_addMessageNamedValue(msg, "routine-depth", ws);
+	snprintf(ws, sizeof(ws), "%u", dev->eventq->maxDepth);
+	xPL_addMessageNamedValue(msg, "max-depth", ws);
+	snprintf(ws, sizeof(ws), "%llu", oldest ? (unsigned long long) ((capture_now_us() - oldest) / 1000) : 0ULL);
+	xPL_addMessageNamedValue(msg, "oldest-ms", ws);
+	snprintf(ws, sizeof(ws), "%lu", dev->eventOverflows);
+	xPL_addMessageNamedValue(msg, "overflows", ws);
+	snprintf(ws, sizeof(ws), "%lu", dev->eventq->dropped[EVENTQ_ALARM]);
+	xPL_addMessageNamedValue(msg, "alarm-dropped", ws);
+	snprintf(ws, sizeof(ws), "%lu", dev->eventq->dropped[EVENTQ_ROUTINE]);
+	xPL_addMessageNamedValue(msg, "routine-dropped", ws);
+}
 
-							case 0: /* gateinfo */
-								doGateInfo();
-								break;
+/* Status response builders, indexed by request */
 
-							case 1: /* zonelist */
-								doZoneList();
-								break;
+static const statusBuilder_t statusBuilders[RC_COUNT] = {
+	[RC_GATEINFO] = buildGateInfo,
+	[RC_GATESTAT] = buildGateStat,
+	[RC_RELAYSTAT] = buildRelayStat,
+	[RC_QUEUESTAT] = buildQueueStat
+};
 
-							case 2: /* zoneinfo */
-								doZoneInfo(theMessage);
-								break;
+/*
+ * Note that the inputs to a cached status response have changed
+ */
 
-							case 3: /* gatestat */
-								doGateStat();
-								break;
+static void statusChanged(adDevicePtr_t dev, int request)
+{
+	dev->statusStale |= (1 << request);
+}
 
-							default:
-								break;
-						}
-								
-					}
-				}
-			}
-		}
+/*
+ * Send a cached status response, rebuilding it first if its inputs have changed since it was last sent
+ */
 
+static void sendStatus(adDevicePtr_t dev, int request)
+{
+	if(dev->statusStale & (1 << request)){
+		(*statusBuilders[request])(dev, dev->statusCache[request]);
+		dev->statusStale &= ~(1 << request);
+		debug(DEBUG_ACTION, "%s: Rebuilt %s response", dev->instanceID, requestCommandTable.key[request]);
 	}
+	if(!sendMessage(dev->statusCache[request]))
+		debug(DEBUG_UNEXPECTED, "request.%s transmission failed", requestCommandTable.key[request]);
 }
 
-
-/* 
-* Send LRR trigger message
+/*
+* Send the reply to a request. A zoneinfo request here is the one for every zone.
 */
 
-
-static void doLRRTrigger(String line)
+static void sendReply(adDevicePtr_t dev, int request)
 {
-	String plist[4];
-	int i;
-
-	plist[0] = NULL;
+	switch(request){
+		case RC_ZONELIST:
+			sendZoneParts(dev, &dev->zoneList, "zonelist", FALSE);
+			break;
 
-	/* Split the message */
+		case RC_ZONEINFO:
+			sendZoneParts(dev, &dev->zoneInfo, "zoneinfo", TRUE);
+			break;
 
+		case RC_QUEUESTAT: /* Always current */
+			statusChanged(dev, RC_QUEUESTAT);
+			sendStatus(dev, RC_QUEUESTAT);
+			break;
 
-	if(3 == splitString(line, plist, ',', 3)){
-		
-		/* If OPEN or CANCEL, clear the alarmLRR flag */
-		if((!strcmp(plist[2], "OPEN")) || (!strcmp(plist[2], "CANCEL")))
-			alarmLRR = FALSE;
-			
-		/* Try to find a match to an xPL equivalent reporting state */
-		for(i = 0; lrrNameMap[i].ademco; i++){
-			if(!strcmp(lrrNameMap[i].ademco, plist[2]))
-				break;
-		}
-		if(lrrNameMap[i].ademco){ /* If match */
-			xPL_clearMessageNamedValues(xplEventTriggerMessage);
-			xPL_addMessageNamedValue(xplEventTriggerMessage, "event", lrrNameMap[i].xpl);
-			xPL_sendMessage(xplEventTriggerMessage);
-		
-			/* Update the alarmLRR bit which reflects the status of all the alarms */
-			if(!strcmp(lrrNameMap[i].xpl, "alarm"))
-					alarmLRR = TRUE;
-		}
+		default:
+			sendStatus(dev, request);
+			break;
 	}
-	if(plist[0])
-		free(plist[0]);
 }
 
 /*
-* Send an EXP trigger message
+* Arm the request window timer for the earliest window which has requests waiting on it
 */
 
-static void doEXPTrigger(String line)
+static void requestTimerArm(adDevicePtr_t dev, uint64_t now)
 {
-	String plist[4];
-	int i;
-	expMapPtr_t e;
-	
-	plist[0] = NULL;
-	
-	/* Do not send zone state changes if armed */
-	if(stateBits.armed)
-		return;
-		
+	struct itimerspec when;
+	uint64_t first = 0, delay;
+	unsigned i;
+
+	for(i = 0; i < RC_COUNT; i++){
+		if(dev->requestWindows[i].waiting && ((!first) || (dev->requestWindows[i].end < first)))
+			first = dev->requestWindows[i].end;
+	}
+
+	/* A zero it_value disarms the timer, so never arm it for less than 1 us */
+	delay = (first > now) ? first - now : 1;
+	memset(&when, 0, sizeof(when));
+	if(first){
+		when.it_value.tv_sec = delay / 1000000;
+		when.it_value.tv_nsec = (delay % 1000000) * 1000;
+	}
+	if(timerfd_settime(dev->requestFD, 0, &when, NULL))
+		debug(DEBUG_UNEXPECTED, "%s: Could not arm the request window timer", dev->instanceID);
+}
+
+/*
+* Send the reply for the requests which waited out a window
+*/
+
+static void requestReply(adDevicePtr_t dev, int request, uint64_t now)
+{
+	requestWindowPtr_t rw = &dev->requestWindows[request];
+
+	debug(DEBUG_ACTION, "%s: One %s reply for %u requests", dev->instanceID, requestCommandTable.key[request], rw->waiting);
+	if(rw->waiting > dev->maxServed)
+		dev->maxServed = rw->waiting;
+	rw->waiting = 0;
+	rw->end = now + (uint64_t) requestWindow * 1000;
+	dev->replies++;
+	sendReply(dev, request);
+}
+
+/*
+* Request window timer handler (Callback from xPL)
+*/
+
+static void requestHandler(int fd, int revents, int userValue)
+{
+	adDevicePtr_t dev = devices[userValue];
+	uint64_t expirations, now = capture_now_us();
+	int i;
+
+	if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	for(i = 0; i < RC_COUNT; i++){
+		if(dev->requestWindows[i].waiting && (dev->requestWindows[i].end <= now))
+			requestReply(dev, i, now);
+	}
+	requestTimerArm(dev, now);
+}
+
+/*
+* Answer a request which takes no arguments.
+*
+* Replies are broadcast, so a request which arrives within request-window ms of a reply to the same request
+* waits for the window to end, and one reply is sent for all the requests which waited.
+*/
+
+static void doRequest(adDevicePtr_t dev, int request)
+{
+	requestWindowPtr_t rw = &dev->requestWindows[request];
+	uint64_t now;
+
+	dev->requests++;
+	if(dev->requestFD < 0){
+		dev->replies++;
+		sendReply(dev, request);
+		return;
+	}
+
+	now = capture_now_us();
+	if(rw->end > now){ /* Inside the window, wait for it to end */
+		if(!rw->waiting++)
+			requestTimerArm(dev, now);
+		return;
+	}
+
+	/* Nothing sent lately, reply now and open a window */
+	rw->end = now + (uint64_t) requestWindow * 1000;
+	if(!dev->maxServed)
+		dev->maxServed = 1;
+	dev->replies++;
+	sendReply(dev, request);
+}
+
+
+
+/*
+* Send queued events, at most limit of them
+*/
+
+static void eventDrain(adDevicePtr_t dev, unsigned limit)
+{
+	eventqEntryPtr_t e;
+	xPL_MessagePtr msg;
+	unsigned i;
+
+	for(; limit && (e = eventq_peek(dev->eventq)); limit--){
+		msg = e->target;
+		xPL_clearMessageNamedValues(msg);
+		for(i = 0; i < e->count; i++)
+			xPL_addMessageNamedValue(msg, (String) e->name[i], e->text + e->value[i]);
+		if(!sendMessage(msg))
+			debug(DEBUG_UNEXPECTED, "%s: Event transmission failed", dev->instanceID);
+		eventq_pop(dev->eventq);
+	}
+}
+
+/*
+* Event queue handler (Callback from xPL)
+*
+* A few events are sent each time around the poll loop, so the serial port gets its turn in between.
+*/
+
+static void eventHandler(int fd, int revents, int userValue)
+{
+	adDevicePtr_t dev = devices[userValue];
+
+	eventDrain(dev, EVENT_BURST);
+	eventq_ack(dev->eventq);
+}
+
+/*
+* Start an event to be sent with a trigger message.
+* Nothing is sent from here, so the serial side never waits on the network. If the queue is full,
+* the oldest routine event is dropped to make room. Alarms may also drop the oldest alarm, routine events may not.
+* Return NULL if the event itself has to be dropped.
+*/
+
+static eventqEntryPtr_t eventStart(adDevicePtr_t dev, unsigned lane, xPL_MessagePtr msg)
+{
+	eventqEntryPtr_t e;
+
+	if(!(e = eventq_start(dev->eventq, lane, msg, capture_now_us()))){
+		dev->eventOverflows++;
+		if(eventq_drop(dev->eventq, EVENTQ_ROUTINE))
+			debug(DEBUG_UNEXPECTED, "%s: Event queue full, dropped the oldest routine event", dev->instanceID);
+		else if((lane == EVENTQ_ALARM) && eventq_drop(dev->eventq, EVENTQ_ALARM))
+			debug(DEBUG_UNEXPECTED, "%s: Event queue full of alarms, dropped the oldest alarm", dev->instanceID);
+		else{
+			debug(DEBUG_UNEXPECTED, "%s: Event queue full of alarms, dropped a routine event", dev->instanceID);
+			dev->eventq->dropped[EVENTQ_ROUTINE]++;
+			return NULL;
+		}
+		e = eventq_start(dev->eventq, lane, msg, capture_now_us());
+	}
+	return e;
+}
+
+/*
+* Queue a trigger message with an event, and a zone if zone isn't NULL
+*/
+
+static void queueTrigger(adDevicePtr_t dev, unsigned lane, xPL_MessagePtr msg, const String event, const String zone)
+{
+	eventqEntryPtr_t e;
+
+	if(!(e = eventStart(dev, lane, msg)))
+		return;
+	eventq_add(e, "event", event);
+	if(zone)
+		eventq_add(e, "zone", zone);
+	eventq_commit(dev->eventq, lane);
+}
+
+/*
+* Queue an unsolicited gateway status message
+*/
+
+static void pushGateStat(adDevicePtr_t dev)
+{
+	unsigned lane = dev->stateBits.alarm ? EVENTQ_ALARM : EVENTQ_ROUTINE;
+	eventqEntryPtr_t e;
+
+	if(!(e = eventStart(dev, lane, dev->gateStatMessage))){
+		dev->gateStatTimer = 1; /* Try again on the next tick */
+		return;
+	}
+	eventq_add(e, "ac-fail", dev->stateBits.acfail ? "true" : "false");
+	eventq_add(e, "low-battery", dev->stateBits.lowbatt ? "true" : "false");
+	eventq_add(e, "status", gateStatus(dev));
+	eventq_commit(dev->eventq, lane);
+
+	dev->gateStatSent = gateStatKey(dev);
+	dev->gateStatTimer = gateStatHeartbeat;
+}
+
+/*
+ * Watch for the serial port becoming writable only while there is something in its transmit queue
+ */
+
+static void serialWatch(adDevicePtr_t dev)
+{
+	Bool want;
+
+	if(!dev->serio)
+		return;
+
+	want = serio_tx_pending(dev->serio) ? TRUE : FALSE;
+	if(want == dev->txWatch)
+		return;
+
+	/* With the ingestion thread running, the port is only in the poll list while there is something to send */
+	if((dev->txWatch || !dev->ingest) && !xPL_removeIODevice(serio_fd(dev->serio)))
+		debug(DEBUG_UNEXPECTED,"Could not unregister from poll list");
+	if((want || !dev->ingest) && !xPL_addIODevice(serioHandler, dev->index, serio_fd(dev->serio), !dev->ingest, want, FALSE))
+		fatal("Could not register serial I/O fd with xPL");
+	dev->txWatch = want;
+}
+
+/*
+ * Arm or disarm the system
+ */
+ 
+
+void doArmDisarm(adDevicePtr_t dev, xPL_MessagePtr theMessage, int cmd)
+{
+	const String code = xPL_getMessageNamedValue(theMessage, "id");
+	
+	if(!code) /* If no code, then bail */
+		return;
+
+	if(!dev->serio){
+		debug(DEBUG_UNEXPECTED, "%s: Serial port is down, arm/disarm dropped", dev->instanceID);
+		return;
+	}
+	
+	if(cmd < 2){
+		if(dev->stateBits.ready){
+			serio_printf(dev->serio, "%s%c", code, (cmd == 0) ? '3' : '2');
+		}
+		else{ /* arming failed, send error trigger message */
+			queueTrigger(dev, EVENTQ_ROUTINE, dev->eventTriggerMessage, "error", NULL);
+		}
+	}
+	else{ /* disarm */
+		serio_printf(dev->serio, "%s1", code);
+	}
+
+	/* The keystrokes go out when the port is writable */
+	serialWatch(dev);
+}
+
+
+
+/*
+* Our Listener 
+*/
+
+
+
+static void xPLListener(xPL_MessagePtr theMessage, xPL_ObjectPtr userValue)
+{
+	ALLOCHECK_BEGIN;
+
+	if(!xPL_isBroadcastMessage(theMessage)){ /* If not a broadcast message */
+		if(xPL_MESSAGE_COMMAND == xPL_getMessageType(theMessage)){ /* If the message is a command */
+			const String iID = xPL_getTargetInstanceID(theMessage);
+			adDevicePtr_t dev = deviceLookup(iID);
+			const String type = xPL_getSchemaType(theMessage);
+			const String class = xPL_getSchemaClass(theMessage);
+			const String command =  xPL_getMessageNamedValue(theMessage, "command");
+			const String request =  xPL_getMessageNamedValue(theMessage, "request");
+		
+				
+			debug(DEBUG_EXPECTED,"Non-broadcast message received: type=%s, class=%s", type, class);
+			
+			if(dev && (!strcmp(class, "security"))){
+				
+				if(!strcmp(type, "basic")){ /* Basic command schema */
+					if(command){
+						int index;
+						switch((index = perfhash_lookup(&basicCommandTable, command, strlen(command)))){
+							
+							case BC_ARM_AWAY:
+							case BC_ARM_HOME:
+							case BC_DISARM:
+								doArmDisarm(dev, theMessage, index);
+								break;
+							
+							default:
+								break;
+						}
+					}
+				}
+				else if(!strcmp(type, "request")){ /* Request command schema */
+					if(request){
+						int index;
+						switch((index = perfhash_lookup(&requestCommandTable, request, strlen(request)))){
+
+							case RC_GATEINFO:
+							case RC_ZONELIST:
+							case RC_GATESTAT:
+							case RC_RELAYSTAT:
+							case RC_QUEUESTAT:
+								doRequest(dev, index);
+								break;
+
+							case RC_ZONEINFO:
+								doZoneInfo(dev, theMessage);
+								break;
+
+							default:
+								break;
+						}
+								
+					}
+				}
+			}
+		}
+
+	}
+	ALLOCHECK_END("an xPL message");
+}
+
+
+/* 
+* Send LRR trigger message
+*/
+
+
+static void doLRRTrigger(adDevicePtr_t dev, const serioView_t *line)
+{
+	serioView_t plist[4];
+	int i;
+
+	/* Split the message */
+
+
+	if(3 == splitView(line, plist, ',', 3)){
+		
+		i = perfhash_lookup(&lrrNameTable, plist[2].text, plist[2].len);
+
+		/* If OPEN or CANCEL, clear the alarmLRR flag */
+		if((i == LRR_OPEN) || (i == LRR_CANCEL))
+			dev->alarmLRR = FALSE;
+			
+		/* Send the xPL equivalent reporting state if there is one */
+		if((i >= 0) && lrrNameTable.value[i]){
+			/* Update the alarmLRR bit which reflects the status of all the alarms */
+			if(!strcmp(lrrNameTable.value[i], "alarm"))
+					dev->alarmLRR = TRUE;
+
+			queueTrigger(dev, dev->alarmLRR ? EVENTQ_ALARM : EVENTQ_ROUTINE, dev->eventTriggerMessage,
+			(String) lrrNameTable.value[i], NULL);
+		}
+
+		/* The alarm state has to be re-evaluated on the next keypad message, even if it is a repeat */
+		keypad_cache_forget_last(dev->kpCache);
+	}
+}
+
+/*
+* Return the name a zone is reported by. Unmapped zones are reported by number.
+*/
+
+static String zoneName(zoneMapPtr_t zm, unsigned num, String ws, unsigned size)
+{
+	if(zm)
+		return zm->zone_name;
+	snprintf(ws, size, "%u", num);
+	return ws;
+}
+
+/*
+* Send the coalesced zone transitions. Consecutive transitions with the same message and event
+* go out together in one message with a zone name-value pair for each zone.
+*/
+
+static void coalesceFlush(adDevicePtr_t dev)
+{
+	static const struct itimerspec disarm;
+	coalesceEntryPtr_t ce;
+	eventqEntryPtr_t e = NULL;
+	unsigned i, sent = 0, merged = 0, dropped = 0;
+	String zone;
+	char ws[12];
+
+	if(!dev->coalesceCount)
+		return;
+
+	for(i = 0; i < dev->coalesceCount; i++){
+		ce = &dev->coalesce[i];
+		zone = zoneName(ce->zm, ce->num, ws, sizeof(ws));
+		/* Add it to the open message if it matches */
+		if(e && (ce->msg == ce[-1].msg) && (ce->event == ce[-1].event) && eventq_add(e, "zone", zone)){
+			merged++;
+			continue;
+		}
+		/* Start a new message */
+		if(e)
+			eventq_commit(dev->eventq, EVENTQ_ROUTINE);
+		if(!(e = eventStart(dev, EVENTQ_ROUTINE, ce->msg))){
+			dropped++;
+			continue;
+		}
+		eventq_add(e, "event", ce->event);
+		eventq_add(e, "zone", zone);
+		sent++;
+	}
+	if(e)
+		eventq_commit(dev->eventq, EVENTQ_ROUTINE);
+
+	debug(DEBUG_ACTION, "%s: Sent %u zone transitions in %u messages, %u dropped", dev->instanceID,
+	sent + merged, sent, dropped);
+	dev->coalesceSaved += merged;
+	dev->coalesceDropped += dropped;
+	dev->coalesceCount = 0;
+
+	if(timerfd_settime(dev->coalesceFD, 0, &disarm, NULL))
+		debug(DEBUG_UNEXPECTED, "%s: Could not disarm the coalescing timer", dev->instanceID);
+}
+
+/*
+* Coalescing window timer handler (Callback from xPL)
+*/
+
+static void coalesceHandler(int fd, int revents, int userValue)
+{
+	uint64_t expirations;
+
+	if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	coalesceFlush(devices[userValue]);
+}
+
+/*
+* Token bucket rate limit for a zone's transitions
+*
+* The bucket holds up to ratePeriod seconds of credit, and each transition costs ratePeriod / rateBurst of it.
+* A zone which runs out is flapping. Its transitions are suppressed until the bucket is full again, which
+* is the hysteresis: a flapping zone has to stay quiet for a whole period before it is reported again.
+* Return TRUE if the transition is to be suppressed.
+*/
+
+static Bool zoneRateLimit(adDevicePtr_t dev, zoneMapPtr_t zm, xPL_MessagePtr msg, const String event)
+{
+	uint64_t now = capture_now_us();
+	uint64_t full = (uint64_t) zm->ratePeriod * 1000000;
+	uint64_t cost = full / zm->rateBurst;
+
+	zm->credit += now - zm->creditTime;
+	if(zm->credit > full)
+		zm->credit = full;
+	zm->creditTime = now;
+
+	if(!zm->flapping){
+		if(zm->credit >= cost){
+			zm->credit -= cost;
+			return FALSE;
+		}
+		zm->flapping = TRUE;
+		dev->flappingCount++;
+		sendZoneEvent(dev, msg, zm, zm->zone_num, "flapping");
+	}
+
+	/* Suppressed transitions still drain the bucket, so the zone has to quiet down to recover */
+	zm->credit = (zm->credit > cost) ? zm->credit - cost : 0;
+
+	/* Remember the latest state, it is sent when the zone settles down */
+	zm->heldEvent = event;
+	zm->flapMessage = msg;
+	dev->suppressed++;
+	return TRUE;
+}
+
+/*
+* End flapping for the zones whose buckets have filled up again, and send their current state if it changed
+*/
+
+static void zoneFlapCheck(adDevicePtr_t dev)
+{
+	uint64_t now = capture_now_us();
+	zoneMapPtr_t zm;
+
+	if(!dev->flappingCount)
+		return;
+
+	for(zm = dev->zoneMapHead; zm; zm = zm->next){
+		if((!zm->flapping) || (zm->credit + (now - zm->creditTime) < (uint64_t) zm->ratePeriod * 1000000))
+			continue;
+		zm->flapping = FALSE;
+		dev->flappingCount--;
+		sendZoneEvent(dev, zm->flapMessage, zm, zm->zone_num, "flapping-ok");
+		if(strcmp(zm->heldEvent, zm->lastEvent ? zm->lastEvent : ""))
+			sendZoneEvent(dev, zm->flapMessage, zm, zm->zone_num, zm->heldEvent);
+	}
+}
+
+/*
+* Send a zone event trigger message.
+*
+* With a coalescing window set, alert and normal transitions are held for the window and sent together.
+* Anything else, and every event while the panel is armed or in alarm or for a 24 hour zone, goes out at once
+* behind the transitions already held.
+*/
+
+static void sendZoneEvent(adDevicePtr_t dev, xPL_MessagePtr msg, zoneMapPtr_t zm, unsigned num, const String event)
+{
+	static struct itimerspec window;
+	coalesceEntryPtr_t ce;
+	char ws[12];
+
+	Bool alarm = dev->stateBits.armed || dev->stateBits.alarm || (zm && zm->alarmClass);
+	Bool transition = (!strcmp(event, "alert")) || (!strcmp(event, "normal"));
+
+	/* Rate limit chattering zones, alarms are never held back */
+	if(zm && transition){
+		if((!alarm) && zm->rateBurst && zoneRateLimit(dev, zm, msg, event)){
+			debug(DEBUG_ACTION, "%s: Zone %s: %s suppressed", dev->instanceID, zm->zone_name, event);
+			return;
+		}
+		zm->lastEvent = event;
+	}
+
+	debug(DEBUG_EXPECTED, "%s: Zone %s: %s", dev->instanceID, zoneName(zm, num, ws, sizeof(ws)), event);
+
+	if(alarm){
+		coalesceFlush(dev);
+		queueTrigger(dev, EVENTQ_ALARM, msg, event, zoneName(zm, num, ws, sizeof(ws)));
+		return;
+	}
+
+	if((dev->coalesceFD < 0) || (!transition)){
+		coalesceFlush(dev);
+		queueTrigger(dev, EVENTQ_ROUTINE, msg, event, zoneName(zm, num, ws, sizeof(ws)));
+		return;
+	}
+
+	if(dev->coalesceCount == COALESCE_MAX)
+		coalesceFlush(dev);
+
+	/* The window starts with the first transition held */
+	if(!dev->coalesceCount){
+		window.it_value.tv_sec = coalesceWindow / 1000;
+		window.it_value.tv_nsec = (coalesceWindow % 1000) * 1000000;
+		if(timerfd_settime(dev->coalesceFD, 0, &window, NULL))
+			debug(DEBUG_UNEXPECTED, "%s: Could not arm the coalescing timer", dev->instanceID);
+	}
+
+	ce = &dev->coalesce[dev->coalesceCount++];
+	ce->msg = msg;
+	ce->event = event;
+	ce->zm = zm;
+	ce->num = num;
+}
+
+/*
+* Send a zone trigger message for a numeric zone.
+* Unmapped zones are still tracked, but are not reported.
+*/
+
+static void doZoneTrigger(adDevicePtr_t dev, unsigned zone, Bool alert)
+{
+	zoneMapPtr_t zm;
+
+	if(!(zm = zoneNumLookup(dev, zone))){
+		debug(DEBUG_EXPECTED, "%s: Zone %u is not mapped, not reporting it", dev->instanceID, zone);
+		return;
+	}
+	sendZoneEvent(dev, dev->zoneTriggerMessage, zm, zone, alert ? "alert" : "normal");
+}
+
+/*
+* Send an EXP trigger message
+*/
+
+static void doEXPTrigger(adDevicePtr_t dev, const serioView_t *line)
+{
+	serioView_t plist[4];
+	unsigned addr, channel;
+	expMapPtr_t e;
+	
+	/* Do not send zone state changes if armed */
+	if(dev->stateBits.armed)
+		return;
+		
 	/* Split the message */
-	if(3 == splitString(line, plist, ',', 3)){
-		for(e = expMapHead; e ; e = e->next){
-			/* debug(DEBUG_EXPECTED,"plist[0]: %s, plist[1]: %s, e->addr: %d, e->channel: %d", plist[0], plist[1], e->addr, e->channel); */
-			if((atoi(plist[0]) == e->addr)&&(atoi(plist[1]) == e->channel))
-				break;
+	if(3 == splitView(line, plist, ',', 3)){
+		addr = viewToUns(&plist[0]);
+		channel = viewToUns(&plist[1]);
+		if((addr > EXP_MAX_ADDR) || (channel > EXP_MAX_CHANNEL) || (!dev->expIndex[addr]))
+			return;
+		if((e = dev->expIndex[addr][channel])) /* If match */
+			sendZoneEvent(dev, dev->eventTriggerMessage, e->zone_entry, 0, viewToUns(&plist[2]) ? "alert" : "normal");
+	}
+
+}
+
+/*
+* Update the relay table, and send a relay trigger message if the relay changed state
+*/
+
+static void doRELTrigger(adDevicePtr_t dev, const serioView_t *line)
+{
+	serioView_t plist[4];
+	relayStatePtr_t rs;
+	eventqEntryPtr_t e;
+	unsigned addr, channel;
+	int state;
+	char ws[20];
+
+	/* Split the message */
+	if(3 != splitView(line, plist, ',', 3))
+		return;
+
+	addr = viewToUns(&plist[0]);
+	channel = viewToUns(&plist[1]);
+	state = viewToUns(&plist[2]) ? 1 : 0;
+	if((addr >= REL_ADDRS) || (!channel) || (channel > REL_CHANNELS)){
+		debug(DEBUG_UNEXPECTED, "%s: Relay address %u, channel %u out of range", dev->instanceID, addr, channel);
+		return;
+	}
+
+	rs = &dev->relays[addr][channel - 1];
+	if(rs->state == state)
+		return;
+	rs->state = state;
+	statusChanged(dev, RC_RELAYSTAT);
+
+	if(!(e = eventStart(dev, EVENTQ_ROUTINE, dev->relayTriggerMessage)))
+		return;
+	eventq_add(e, "relay", relayName(dev, addr, channel, ws, sizeof(ws)));
+	eventq_add(e, "state", state ? "on" : "off");
+	eventq_commit(dev->eventq, EVENTQ_ROUTINE);
+}
+
+/*
+* Return the hash bucket for an RFX serial number
+*/
+
+static unsigned rfxHashIndex(uint32_t serial)
+{
+	return (serial * 2654435761U) >> (32 - RFX_HASH_BITS);
+}
+
+/*
+* Find a wireless sensor by serial number
+*/
+
+static rfxSensorPtr_t rfxLookup(adDevicePtr_t dev, uint32_t serial)
+{
+	rfxSensorPtr_t rs;
+
+	for(rs = dev->rfxHash[rfxHashIndex(serial)]; rs; rs = rs->next){
+		if(rs->serial == serial)
+			break;
+	}
+	return rs;
+}
+
+/*
+* Send RFX trigger messages for the status bits which changed
+*/
+
+static void doRFXTrigger(adDevicePtr_t dev, const serioView_t *line)
+{
+	serioView_t plist[3];
+	rfxSensorPtr_t rs;
+	unsigned status, changed, i;
+	zoneMapPtr_t zone = NULL;
+
+	/* Split the message */
+	if(2 != splitView(line, plist, ',', 2))
+		return;
+
+	if(!(rs = rfxLookup(dev, viewToUns(&plist[0]))))
+		return;
+
+	status = (unsigned) strtoul(plist[1].text, NULL, 16);
+	changed = status ^ rs->status;
+	rs->status = status;
+
+	for(i = 0; i < RFX_LOOPS; i++){
+		if(!rs->loop_zone[i])
+			continue;
+		if(!zone) /* Battery and supervision are reported against the first mapped loop */
+			zone = rs->loop_zone[i];
+
+		/* Do not send zone state changes if armed */
+		if((changed & rfxLoopBits[i]) && (!dev->stateBits.armed))
+			sendZoneEvent(dev, dev->zoneTriggerMessage, rs->loop_zone[i], 0, (status & rfxLoopBits[i]) ? "alert" : "normal");
+	}
+
+	if(changed & RFX_LOW_BATTERY)
+		sendZoneEvent(dev, dev->zoneTriggerMessage, zone, 0, (status & RFX_LOW_BATTERY) ? "low-battery" : "battery-ok");
+	if(changed & RFX_SUPERVISION)
+		sendZoneEvent(dev, dev->zoneTriggerMessage, zone, 0, (status & RFX_SUPERVISION) ? "supervision" : "supervision-ok");
+}
+
+
+
+/*
+* Clear the faulted zones in the bit set which are above lo and below hi
+*/
+
+static void zoneFaultClearRange(adDevicePtr_t dev, unsigned lo, unsigned hi)
+{
+	unsigned w, zone;
+	uint32_t bits;
+
+	for(w = (lo + 1) >> 5; (w << 5) < hi; w++){
+		bits = dev->faultBits[w];
+		if((w << 5) <= lo)
+			bits &= ~0U << ((lo + 1) & 31);
+		if(((w + 1) << 5) > hi)
+			bits &= ~(~0U << (hi & 31));
+		dev->faultBits[w] &= ~bits;
+		while(bits){
+			zone = (w << 5) + __builtin_ctz(bits);
+			bits &= bits - 1;
+			dev->faultCount--;
+			doZoneTrigger(dev, zone, FALSE);
+		}
+	}
+}
+
+/*
+* Clear all faulted zones
+*/
+
+static void zoneFaultClearAll(adDevicePtr_t dev)
+{
+	if(dev->faultCount)
+		zoneFaultClearRange(dev, 0, FAULT_ZONES);
+	dev->lastFault = 0;
+}
+
+/*
+* The display is showing a fault for a zone.
+*
+* The panel shows the faulted zones in ascending order and starts over at the lowest. When a zone
+* already known to be faulted comes around again, any faulted zones the rotation skipped since the
+* previous fault display have been restored.
+*/
+
+static void zoneFaultSeen(adDevicePtr_t dev, unsigned zone, uint32_t now)
+{
+	unsigned last = dev->lastFault;
+	uint32_t mask;
+
+	if((!zone) || (zone >= FAULT_ZONES))
+		return;
+
+	mask = 1U << (zone & 31);
+	if(!(dev->faultBits[zone >> 5] & mask)){
+		/* New fault */
+		dev->faultBits[zone >> 5] |= mask;
+		dev->faultCount++;
+		doZoneTrigger(dev, zone, TRUE);
+	}
+	else if(last && (zone != last)){
+		if(zone > last)
+			zoneFaultClearRange(dev, last, zone);
+		else{ /* Wrapped around */
+			zoneFaultClearRange(dev, last, FAULT_ZONES);
+			zoneFaultClearRange(dev, 0, zone);
 		}
-		if(e){ /* If match */
-			i = atoi(plist[2]);
-			xPL_clearMessageNamedValues(xplEventTriggerMessage);
-			xPL_addMessageNamedValue(xplEventTriggerMessage, "event", i ? "alert" : "normal");
-			xPL_addMessageNamedValue(xplEventTriggerMessage, "zone", e->zone);
-			xPL_sendMessage(xplEventTriggerMessage);
+	}
+	dev->faultSeen[zone] = now;
+	dev->lastFault = zone;
+}
+
+/*
+* Restore the faulted zones which haven't been displayed for FAULT_EXPIRE seconds.
+* This catches the zones the rotation can't, e.g. when only one fault is left on the display.
+*/
+
+static void zoneFaultExpire(adDevicePtr_t dev, uint32_t now)
+{
+	unsigned w, zone;
+	uint32_t bits;
+
+	if((!dev->faultCount) || dev->stateBits.armed)
+		return;
+
+	for(w = 0; w < FAULT_ZONES / 32; w++){
+		for(bits = dev->faultBits[w]; bits; bits &= bits - 1){
+			zone = (w << 5) + __builtin_ctz(bits);
+			if(now - dev->faultSeen[zone] > FAULT_EXPIRE){
+				dev->faultBits[w] &= ~(1U << (zone & 31));
+				dev->faultCount--;
+				if(zone == dev->lastFault)
+					dev->lastFault = 0;
+				doZoneTrigger(dev, zone, FALSE);
+			}
 		}
 	}
-	if(plist[0])
-		free(plist[0]);
+}
+
+
+/*
+* Status bit change handlers
+*/
+
+static void statReady(adDevicePtr_t dev, uint32_t word)
+{
+	dev->stateBits.ready = (word & KEYPAD_READY) ? 1 : 0;
+}
+
+static void statArmed(adDevicePtr_t dev, uint32_t word)
+{
+	/* If anything is armed */
+	dev->stateBits.armed = (word & STAT_ARMED_BITS) ? 1 : 0;
+	statusChanged(dev, RC_GATESTAT);
+}
+
+static void statAlarm(adDevicePtr_t dev, uint32_t word)
+{
+	/* If any alarm including one sent from LRR */
+	dev->stateBits.alarm = (word & STAT_ALARM_BITS) ? 1 : 0;
+	statusChanged(dev, RC_GATESTAT);
+}
+
+static void statACFail(adDevicePtr_t dev, uint32_t word)
+{
+	dev->stateBits.acfail = (word & KEYPAD_AC_POWER) ? 0 : 1;
+	statusChanged(dev, RC_GATESTAT);
+}
 
+static void statLowBatt(adDevicePtr_t dev, uint32_t word)
+{
+	dev->stateBits.lowbatt = (word & KEYPAD_LOW_BATTERY) ? 1 : 0;
+	statusChanged(dev, RC_GATESTAT);
 }
 
+static const statHandler_t statHandlers[] = {
+	{ KEYPAD_READY, statReady },
+	{ STAT_ARMED_BITS, statArmed },
+	{ STAT_ALARM_BITS, statAlarm },
+	{ KEYPAD_AC_POWER, statACFail },
+	{ KEYPAD_LOW_BATTERY, statLowBatt },
+	{ 0, NULL }
+};
+
+
+/*
+* Process one line received from the panel
+*/
+
+static void processLine(adDevicePtr_t dev, const serioView_t *view, uint64_t now)
+{
+	const keypadMsg_t *kp;
+	const statHandler_t *sh;
+	const char *line = view->text;
+	uint32_t word, changed, lrr;
+	Bool repeat;
+
+	if(line[0] == '['){ /* Keypad message */
+		if(!(kp = keypad_cache_lookup(dev->kpCache, line, view->len, now, &repeat))){
+			debug(DEBUG_UNEXPECTED, "%s: Malformed keypad message: %s", dev->instanceID, line);
+			return;
+		}
+		if(repeat){ /* Same as the last one, nothing to do but note the fault is still displayed */
+			if(dev->displayFault)
+				dev->faultSeen[dev->displayFault] = (uint32_t) (now / 1000000);
+			return;
+		}
+
+		/* Display text */
+		if((strlen(dev->display) != kp->alphaLen) || memcmp(dev->display, kp->alpha, kp->alphaLen)){
+			memcpy(dev->display, kp->alpha, kp->alphaLen);
+			dev->display[kp->alphaLen] = 0;
+			debug(DEBUG_EXPECTED, "%s: Display: %s", dev->instanceID, dev->display);
+		}
+
+		/*
+		* Status bits, a plain character compare catches the usual case of nothing changing.
+		* Otherwise they are packed, and only the handlers for the bits which changed are run.
+		*/
+		lrr = dev->alarmLRR ? STAT_LRR_ALARM : 0;
+		changed = 0;
+		if((!dev->statBitsSeen) || memcmp(dev->statBits, kp->bits, KEYPAD_BITS_LEN) || ((dev->statWord & STAT_LRR_ALARM) != lrr)){
+			memcpy(dev->statBits, kp->bits, KEYPAD_BITS_LEN);
+			word = keypad_pack_bits(kp->bits) | lrr;
+			changed = dev->statBitsSeen ? word ^ dev->statWord : ~0;
+		}
+		if(changed){
+			if(dev->statBitsSeen && (changed & KEYPAD_ALL_BITS))
+				debug(DEBUG_EXPECTED,"%s: New Status bits: %.*s", dev->instanceID, KEYPAD_BITS_LEN, kp->bits);
+			dev->statBitsSeen = TRUE;
+			dev->statWord = word;
+			for(sh = statHandlers; sh->handler; sh++){
+				if(changed & sh->mask)
+					(*sh->handler)(dev, word);
+			}
+
+			/* Push the gateway status when something in it changed */
+			if(dev->gateStatSent != gateStatKey(dev))
+				pushGateStat(dev);
+		}
 
+		/* Zone faults, nothing is faulted when the panel is ready */
+		dev->displayFault = 0;
+		if(dev->stateBits.ready)
+			zoneFaultClearAll(dev);
+		else if(keypad_is_fault(kp) && (kp->number < FAULT_ZONES)){
+			dev->displayFault = kp->number;
+			zoneFaultSeen(dev, kp->number, (uint32_t) (now / 1000000));
+		}
+	}
+	else if((line[0] == '!') && (view->len > 5)){ /* Other events */
+		serioView_t p = { line + 5, view->len - 5 };
+		if(!strncmp(line + 1, "EXP", 3)){ /* Expander event ? */
+			debug(DEBUG_EXPECTED,"Expander event: %s", p.text);
+			doEXPTrigger(dev, &p);
+		}
+		if(!strncmp(line + 1, "LRR", 3)){ /* Long Range radio event ? */
+			debug(DEBUG_EXPECTED,"Long Range Radio event: %s", p.text);
+			doLRRTrigger(dev, &p);
+		}
+		if(!strncmp(line + 1, "REL", 3)){ /* Relay event ? */
+			debug(DEBUG_EXPECTED,"Relay event: %s", p.text);
+			doRELTrigger(dev, &p);
+		}
+		if(!strncmp(line + 1, "RFX", 3)){ /* Wireless sensor event ? */
+			debug(DEBUG_EXPECTED,"Wireless event: %s", p.text);
+			doRFXTrigger(dev, &p);
+		}
+	}
+}
 
 /*
 * Serial I/O handler (Callback from xPL)
+* With the ingestion thread running, this is only called to drain the transmit queue.
 */
 
 static void serioHandler(int fd, int revents, int userValue)
 {
-	static Bool firstTime = TRUE;
-	String line;
-	char newStatBits[21];
-	static char oldStatBits[21];
-
-	
+	adDevicePtr_t dev = devices[userValue];
+	serioView_t view;
+	uint64_t now;
+	int res;
+	ALLOCHECK_BEGIN;
+
+	/* Send what we can from the transmit queue */
+	if(revents & POLLOUT){
+		if(serio_tx_flush(dev->serio) < 0)
+			debug(DEBUG_UNEXPECTED, "%s: Keypad data lost", dev->instanceID);
+		serialWatch(dev);
+		if(!(revents & (POLLIN | POLLHUP | POLLERR)))
+			return;
+	}
+	if(dev->ingest)
+		return; /* The ingestion thread does the reading */
 	
-	/* Do non-blocking line read */
-	if(serio_nb_line_readcr(serioStuff)){
-		/* Got a line or EOF */
-		if(serio_ateof(serioStuff)){
-			debug(DEBUG_EXPECTED, "EOF detected on serial port, closing port");
-			if(!xPL_removeIODevice(serio_fd(serioStuff))) /* Unregister ourself */
-				debug(DEBUG_UNEXPECTED,"Could not unregister from poll list");
-			serio_close(serioStuff); /* Close serial port */
-			serioStuff = NULL;
-			serialRetryTimer = SERIAL_RETRY_TIME;
+	now = capture_now_us();
+
+	/* Do non-blocking line reads until every buffered line is consumed */
+	while((res = serio_nb_line_view(dev->serio, &view)) != 0){
+		/* Got a line, EOF, or a read error (EIO when a USB adapter is unplugged) */
+		if((res < 0) || serio_ateof(dev->serio)){
+			serialLost(dev);
+			ALLOCHECK_END("a serial line");
 			return; /* Bail */
 		}
-		lineReceived = TRUE;
-		line = serio_line(serioStuff);
-		if(line[0] == '['){ /* Parse the status bits */
-			confreadStringCopy(newStatBits, line + 1, 21);
-			if(firstTime){ /* Set new and old the same on first time */
-				firstTime = FALSE;
-				confreadStringCopy(oldStatBits, newStatBits, 21);
-			}
-			if(strcmp(newStatBits, oldStatBits)){
-				confreadStringCopy(oldStatBits, newStatBits, 21);
-				debug(DEBUG_EXPECTED,"New Status bits: %s", newStatBits);
-			}
-			
-			/* If ready */	
-			if(newStatBits[0] == '1')
-				stateBits.ready = 1;
-			else
-				stateBits.ready = 0;
-							
-			/* If anything is armed */
-			if((newStatBits[1] == '1') || (newStatBits[2] == '1') ||
-			   (newStatBits[12] == '1') || (newStatBits[15] == '1'))
-				stateBits.armed = 1;
-			else
-				stateBits.armed = 0;
-				
-			/* If any alarm including one sent from LRR */
-			if((newStatBits[10] == '1') || (newStatBits[13] == '1') || alarmLRR)
-				stateBits.alarm = 1;
-			else
-				stateBits.alarm = 0;
-			
-			/* If AC fail */	
-			if(newStatBits[7] == '0')
-				stateBits.acfail = 1;
-			else
-				stateBits.acfail = 0;
-			
-			/* If low battery */
-			if(newStatBits[11] == '1')
-					stateBits.lowbatt = 1;
-			else
-					stateBits.lowbatt = 0;
-				
-		}
-		else if(line[0] == '!'){ /* Other events */
-			String p = line + 5;
-			if(!strncmp(line + 1, "EXP", 3)){ /* Expander event ? */
-				debug(DEBUG_EXPECTED,"Expander event: %s", p);
-				doEXPTrigger(p);
-			}
-			if(!strncmp(line + 1, "LRR", 3)){ /* Long Range radio event ? */
-				debug(DEBUG_EXPECTED,"Long Range Radio event: %s", p);
-				doLRRTrigger(p);
-			}
+		processLine(dev, &view, now);
+	} /* End serio_nb_line_view */
+	ALLOCHECK_END("a serial line");
+}
+
+/*
+* Ingestion thread handler (Callback from xPL)
+*/
+
+static void ingestHandler(int fd, int revents, int userValue)
+{
+	adDevicePtr_t dev = devices[userValue];
+	serioView_t view;
+	uint64_t time, latency;
+	int res;
+	ALLOCHECK_BEGIN;
+
+	ingest_ack(dev->ingest);
+
+	/* Process every line the thread has handed over */
+	while((res = ingest_next(dev->ingest, &view, &time)) > 0){
+		latency = capture_now_us() - time;
+		if(latency > dev->maxIngestLatency)
+			dev->maxIngestLatency = latency;
+		processLine(dev, &view, time);
+		ingest_release(dev->ingest);
+	}
+	/* The thread stopped on EOF or a read error */
+	if(res < 0)
+		serialLost(dev);
+	ALLOCHECK_END("a serial line");
+}
+
+/*
+* Log the performance counters
+*/
+
+static void logStats(adDevicePtr_t dev)
+{
+	serioStats_t st;
+	uint64_t oldest;
+	unsigned long lines, stalls;
+
+	if(dev->outages)
+		debug(DEBUG_STATUS, "%s: Serial outages: %lu, last reconnect %.3f s, max reconnect %.3f s",
+		dev->instanceID, dev->outages, dev->reconnectLatency / 1e6, dev->maxReconnectLatency / 1e6);
+
+	if(dev->coalesceSaved || dev->coalesceDropped)
+		debug(DEBUG_STATUS, "%s: Zone transition coalescing saved %lu messages, %lu transitions dropped on a full event queue",
+		dev->instanceID, dev->coalesceSaved, dev->coalesceDropped);
+
+	if(dev->requests)
+		debug(DEBUG_STATUS, "%s: Requests: %lu answered with %lu replies, %.2f requests/reply, max %u per reply",
+		dev->instanceID, dev->requests, dev->replies, dev->replies ? (double) dev->requests / dev->replies : 0.0, dev->maxServed);
+
+	if(dev->suppressed || dev->flappingCount)
+		debug(DEBUG_STATUS, "%s: Rate limiting: %lu zone transitions suppressed, %u zones flapping",
+		dev->instanceID, dev->suppressed, dev->flappingCount);
+
+	if(dev->eventq){
+		oldest = eventq_oldest(dev->eventq);
+		debug(DEBUG_STATUS, "%s: Event queue: depth %u alarm, %u routine, max depth %u, %lu queued, %lu overflows, "
+		"%lu alarms and %lu routine events dropped, oldest %llu ms",
+		dev->instanceID, eventq_depth(dev->eventq, EVENTQ_ALARM), eventq_depth(dev->eventq, EVENTQ_ROUTINE),
+		dev->eventq->maxDepth, dev->eventq->queued, dev->eventOverflows,
+		dev->eventq->dropped[EVENTQ_ALARM], dev->eventq->dropped[EVENTQ_ROUTINE],
+		oldest ? (unsigned long long) ((capture_now_us() - oldest) / 1000) : 0ULL);
+	}
 
+	if(dev->serio){
+		serio_get_stats(dev->serio, &st);
+		debug(DEBUG_STATUS, "%s: Serial: %lu reads for %lu lines, %.2f reads/line, %lu wrapped line copies",
+		dev->instanceID, st.reads, st.lines, st.lines ? (double) st.reads / st.lines : 0.0, st.wraps);
+		if(dev->ingest){
+			ingest_get_stats(dev->ingest, &lines, &stalls);
+			debug(DEBUG_STATUS, "%s: Ingestion thread: %lu lines, %lu full ring stalls, max handoff latency %llu us",
+			dev->instanceID, lines, stalls, (unsigned long long) dev->maxIngestLatency);
 		}
+		debug(DEBUG_STATUS, "%s: Keypad cache: %lu hits (%lu repeats), %lu misses",
+		dev->instanceID, dev->kpCache->hits, dev->kpCache->repeats, dev->kpCache->misses);
+		debug(DEBUG_STATUS, "%s: Transmit queue: depth %u, max depth %u, %lu writes, %lu drains, %lu rejects, %lu bytes dropped, latency %llu us, max latency %llu us",
+		dev->instanceID, st.txDepth, st.txMaxDepth, st.writes, st.txDrains, st.txRejects, st.txDropped,
+		(unsigned long long) st.txLatency, (unsigned long long) st.txMaxLatency);
+	}
+}
+
+/*
+* Open a device's serial port and ask xPL to monitor it
+* If flush is TRUE, any partial command in the panel is cancelled and the input discarded first.
+* This is done before the ingestion thread starts, so the thread never sees its receive ring reset under it.
+*/
+
+static Bool serialOpen(adDevicePtr_t dev, Bool flush)
+{
+	if(!(dev->serio = serio_open(dev->comPort, COM_BAUD_RATE)))
+		return FALSE;
+
+	serio_set_capture(dev->serio, dev->capture);
+	dev->txWatch = FALSE;
+
+	if(flush){
+		serio_printf(dev->serio, "\r");
+		serio_tx_flush(dev->serio);
+		usleep(100000);
+		serio_flush_input(dev->serio);
+	}
+
+	if(serialThread){
+		/* The thread reads the port, we read what it hands over */
+		if(!(dev->ingest = ingest_start(dev->serio)))
+			fatal("Could not start the serial ingestion thread for %s", dev->comPort);
+		if(!xPL_addIODevice(ingestHandler, dev->index, ingest_fd(dev->ingest), TRUE, FALSE, FALSE))
+			fatal("Could not register ingestion fd with xPL");
+	}
+	else if(!xPL_addIODevice(serioHandler, dev->index, serio_fd(dev->serio), TRUE, FALSE, FALSE))
+		fatal("Could not register serial I/O fd with xPL");
+	return TRUE;
+}
+
+/*
+* Stop watching for a device's com port node.
+* The watch is kept if another device waiting on a lost port shares it.
+*/
+
+static void nodeWatchRelease(adDevicePtr_t dev)
+{
+	unsigned i;
+
+	if(dev->nodeWatch < 0)
+		return;
+
+	for(i = 0; i < deviceCount; i++){
+		if((devices[i] != dev) && (!devices[i]->serio) && (devices[i]->nodeWatch == dev->nodeWatch))
+			break;
+	}
+	if(i == deviceCount)
+		nodewatch_remove(nodeWatchFD, dev->nodeWatch);
+	dev->nodeWatch = -1;
+}
+
+/*
+* Watch for a device's com port node to reappear.
+* Called again after every failed reopen so the watch follows parent directories as they come back.
+*/
+
+static void nodeWatchUpdate(adDevicePtr_t dev)
+{
+	int wd;
+
+	wd = nodewatch_add(nodeWatchFD, dev->comPort);
+	if(wd != dev->nodeWatch){
+		nodeWatchRelease(dev);
+		dev->nodeWatch = wd;
+	}
+}
+
+/*
+* Try to reopen a lost com port
+*/
+
+static Bool serialReconnect(adDevicePtr_t dev, const char *how)
+{
+	uint64_t latency;
+
+	if(!serialOpen(dev, FALSE))
+		return FALSE;
+
+	latency = capture_now_us() - dev->outageStart;
+	dev->reconnectLatency = latency;
+	if(latency > dev->maxReconnectLatency)
+		dev->maxReconnectLatency = latency;
+	dev->serialRetryTimer = 0;
+	nodeWatchRelease(dev);
+
+	debug(DEBUG_EXPECTED,"Serial reconnect successful on %s after %.3f s (%s)", dev->comPort, latency / 1e6, how);
+	return TRUE;
+}
+
+/*
+* Close a com port which went away, and start waiting for it to come back
+*/
 
-	} /* End serio_nb_line_read */
+static void serialLost(adDevicePtr_t dev)
+{
+	debug(DEBUG_EXPECTED, "EOF or error detected on serial port %s, closing port", dev->comPort);
+	if(dev->ingest){
+		if(!xPL_removeIODevice(ingest_fd(dev->ingest)))
+			debug(DEBUG_UNEXPECTED,"Could not unregister from poll list");
+		if(dev->txWatch && !xPL_removeIODevice(serio_fd(dev->serio)))
+			debug(DEBUG_UNEXPECTED,"Could not unregister from poll list");
+		ingest_stop(dev->ingest); /* Stop the thread before the port goes */
+		dev->ingest = NULL;
+	}
+	else if(!xPL_removeIODevice(serio_fd(dev->serio))) /* Unregister ourself */
+		debug(DEBUG_UNEXPECTED,"Could not unregister from poll list");
+	serio_close(dev->serio); /* Close serial port */
+	dev->serio = NULL;
+
+	dev->outages++;
+	dev->outageStart = capture_now_us();
+
+	/* The node watch reopens the port as soon as it reappears, the retry timer is the fallback */
+	dev->serialRetryDelay = SERIAL_RETRY_MIN;
+	dev->serialRetryTimer = SERIAL_RETRY_MIN;
+	nodeWatchUpdate(dev);
 }
 
+/*
+* Node watch handler (Callback from xPL)
+*/
+
+static void nodeWatchHandler(int fd, int revents, int userValue)
+{
+	adDevicePtr_t dev;
+	unsigned i;
+
+	if(!nodewatch_drain(fd))
+		return;
+
+	/* Something changed in a watched directory, try the lost ports */
+	for(i = 0; i < deviceCount; i++){
+		dev = devices[i];
+		if(dev->serio || (!dev->serialRetryTimer))
+			continue;
+		if(!serialReconnect(dev, "node watch"))
+			nodeWatchUpdate(dev);
+	}
+}
 
 /*
 * Our tick handler. 
@@ -780,32 +2179,134 @@ static void serioHandler(int fd, int revents, int userValue)
 
 static void tickHandler(int userVal, xPL_ObjectPtr obj)
 {
-	static Bool firstTime = TRUE;
-
-	/* Process clock tick update checking */
-	if(firstTime){
-		firstTime = FALSE;
-		xPL_clearMessageNamedValues(xplEventTriggerMessage);
-		xPL_addMessageNamedValue(xplEventTriggerMessage, "event", "ready");
-		xPL_sendMessage(xplEventTriggerMessage);
+	static unsigned statsTimer = STATS_INTERVAL;
+	Bool doStats = FALSE;
+	adDevicePtr_t dev;
+	unsigned i;
+
+	/* Periodically log the performance counters */
+	if(!--statsTimer){
+		statsTimer = STATS_INTERVAL;
+		doStats = TRUE;
 	}
+
+	for(i = 0; i < deviceCount; i++){
+		dev = devices[i];
+
+		/* Process clock tick update checking */
+		if(!dev->readySent){
+			dev->readySent = TRUE;
+			queueTrigger(dev, EVENTQ_ROUTINE, dev->eventTriggerMessage, "ready", NULL);
+		}
+
+		if(doStats)
+			logStats(dev);
+
+		/* Gateway status heartbeat for resync, it starts with the first push */
+		if(dev->gateStatTimer && (!--dev->gateStatTimer))
+			pushGateStat(dev);
+
+		zoneFaultExpire(dev, (uint32_t) (capture_now_us() / 1000000));
+		zoneFlapCheck(dev);
 	
-	if(serialRetryTimer){ /* If this is non-zero, we lost the serial connection, wait retry time and try again */
-		serialRetryTimer--;
-		if(!serialRetryTimer){
-			if(!(serioStuff = serio_open(comPort, COM_BAUD_RATE))){
-				debug(DEBUG_UNEXPECTED,"Serial reconnect failed, trying later...");
-				serialRetryTimer = SERIAL_RETRY_TIME;
-				return;
+		if(dev->serialRetryTimer){ /* If this is non-zero, we lost the serial connection, back off and try again */
+			dev->serialRetryTimer--;
+			if((!dev->serialRetryTimer) && (!serialReconnect(dev, "retry timer"))){
+				dev->serialRetryDelay <<= 1;
+				if(dev->serialRetryDelay > SERIAL_RETRY_MAX)
+					dev->serialRetryDelay = SERIAL_RETRY_MAX;
+				debug(DEBUG_UNEXPECTED,"Serial reconnect failed on %s, trying again in %u seconds",
+				dev->comPort, dev->serialRetryDelay);
+				dev->serialRetryTimer = dev->serialRetryDelay;
+				nodeWatchUpdate(dev);
 			}
-			else{
-				debug(DEBUG_EXPECTED,"Serial reconnect successful");
-				if(!xPL_addIODevice(serioHandler, 1234, serio_fd(serioStuff), TRUE, FALSE, FALSE))
-					fatal("Could not register serial I/O fd with xPL");
+		}
+	}
+
+}
+
+
+/*
+* Feed a capture file through the serial I/O handler of a device, then report the throughput.
+* The records are paced at replaySpeed times real time, or sent as fast as possible if replaySpeed is 0.
+*/
+
+static void doReplay(adDevicePtr_t dev)
+{
+	capturePtr_t cap;
+	char *buf;
+	int pipefd[2], len, i, n;
+	uint32_t delta;
+	uint64_t start, due, now, t0, busy = 0, maxBusy = 0, wall;
+	unsigned long records = 0, bytes = 0;
+	serioStats_t st;
+	struct timespec ts;
+
+	if(!(cap = capture_open_read(replayFile)))
+		fatal("Could not open capture file: %s", replayFile);
+	if(!(buf = malloc(CAPTURE_MAX_RECORD)))
+		MALLOC_ERROR;
+
+	/* The handler reads the replayed bytes from a pipe, just like it would from the serial port */
+	if(pipe(pipefd))
+		fatal_with_reason(errno, "replay pipe");
+	if(fcntl(pipefd[0], F_SETFL, O_NONBLOCK) == -1)
+		fatal_with_reason(errno, "replay pipe fcntl");
+	if(!(dev->serio = serio_fdopen(pipefd[0], replayFile)))
+		MALLOC_ERROR;
+	ALLOCHECK_ARM();
+
+	start = due = capture_now_us();
+	while((len = capture_read(cap, &delta, buf, CAPTURE_MAX_RECORD)) > 0){
+		/* Pace the replay */
+		if(replaySpeed > 0){
+			due += (uint64_t) (delta / replaySpeed);
+			now = capture_now_us();
+			if(due > now){
+				ts.tv_sec = (due - now) / 1000000;
+				ts.tv_nsec = ((due - now) % 1000000) * 1000;
+				nanosleep(&ts, NULL);
 			}
 		}
-	}
 
+		/* Time from the bytes arriving to the handler being done with them */
+		t0 = capture_now_us();
+		for(i = 0; i < len; i += n){
+			n = ((len - i) > SERIO_RING_SIZE) ? SERIO_RING_SIZE : len - i;
+			if(write(pipefd[1], buf + i, n) != n)
+				fatal_with_reason(errno, "replay pipe write");
+			serioHandler(pipefd[0], POLLIN, dev->index);
+			coalesceFlush(dev);
+			eventDrain(dev, UINT_MAX);
+		}
+		t0 = capture_now_us() - t0;
+		busy += t0;
+		if(t0 > maxBusy)
+			maxBusy = t0;
+
+		records++;
+		bytes += len;
+	}
+	wall = capture_now_us() - start;
+
+	if(len < 0)
+		error("Replay stopped at a bad record in %s", replayFile);
+
+	serio_get_stats(dev->serio, &st);
+	printf("Replayed %lu lines, %lu bytes in %lu reads from %s\n", st.lines, bytes, records, replayFile);
+	printf("Wall time: %.3f s, %.0f lines/sec\n", wall / 1e6, wall ? st.lines * 1e6 / wall : 0.0);
+	printf("Processing time: %.3f s, %.0f lines/sec, %.1f us/read average, %llu us/read max\n",
+	busy / 1e6, busy ? st.lines * 1e6 / busy : 0.0, records ? (double) busy / records : 0.0, (unsigned long long) maxBusy);
+	printf("Events: %lu alarm, %lu routine queued\n", dev->eventq->laneQueued[EVENTQ_ALARM], dev->eventq->laneQueued[EVENTQ_ROUTINE]);
+	printf("Messages: %lu not sent, replays don't talk to the network\n", replaySent);
+	printf("Keypad cache: %lu hits (%lu repeats), %lu misses\n",
+	dev->kpCache->hits, dev->kpCache->repeats, dev->kpCache->misses);
+
+	serio_close(dev->serio);
+	dev->serio = NULL;
+	close(pipefd[1]);
+	capture_close(cap);
+	free(buf);
 }
 
 
@@ -821,6 +2322,8 @@ static void showHelp(void)
 	printf("Usage: %s [OPTION]...\n", progName);
 	printf("\n");
 	printf("  -c, --config-file PATH  Set the path to the config file\n");
+	printf("  -C, --capture PATH      Record everything read from the com port with timestamps\n");
+	printf("                          With more than one device, .instance-id is appended to the path\n");
 	printf("  -d, --debug-level LEVEL Set the debug level, 0 is off, the\n");
 	printf("                          compiled-in default is %d and the max\n", debugLvl);
 	printf("                          level allowed is %d\n", DEBUG_MAX);
@@ -829,9 +2332,13 @@ static void showHelp(void)
 	printf("  -i, --interface NAME    Set the broadcast interface (e.g. eth0)\n");
 	printf("  -n, --no-background     Do not fork into the background (useful for debugging)\n");
 	printf("  -p, --com-port PORT     Set the communications port (default is %s)\n", comPort);
-	printf("  -s, --instance ID       Set instance id. Default is %s", instanceID);
+	printf("  -R, --replay PATH       Feed a capture file through the first device, report the throughput, and exit\n");
+	printf("                          With device sections, this applies to the first device\n");
+	printf("  -s, --instance ID       Set instance id. Default is %s\n", instanceID);
+	printf("                          With device sections, this applies to the first device\n");
 	printf("  -u, --debug-file PATH    Path name to debug file when daemonized\n");
 	printf("  -v, --version           Display program version\n");
+	printf("  -x, --replay-speed N    Replay at N times real time, 0 is as fast as possible. Default is 1\n");
 	printf("\n");
  	printf("Report bugs to <%s>\n\n", EMAIL);
 	return;
@@ -851,6 +2358,294 @@ static void syntax_error(KeyEntryPtr_t ke, String configFile, String message)
 }
 
 
+/*
+* Parse a rate limit of the form burst/period, e.g. 6/60 for 6 transitions a minute
+*/
+
+static void parseRateLimit(KeyEntryPtr_t e, const String spec, zoneMapPtr_t zm)
+{
+	String plist[3] = {NULL, NULL, NULL};
+	char work[WS_SIZE];
+
+	if((2 != splitString(spec, work, WS_SIZE, plist, '/', 1)) ||
+	(!str2uns(plist[0], &zm->rateBurst, 1, 1000)) || (!str2uns(plist[1], &zm->ratePeriod, 1, 3600)))
+		syntax_error(e, configFile, "rate limit must be transitions/seconds, e.g. 6/60");
+}
+
+/*
+* Build a device's zone map from a config section
+*/
+
+static void buildZoneMap(adDevicePtr_t dev, const String section)
+{
+	KeyEntryPtr_t e;
+	zoneMapPtr_t zm;
+
+	if(!(e = confreadGetFirstKeyBySection(configEntry, section)))
+		fatal("A valid %s section and at least one entry must be defined in the config file", section);
+	for(; e; e = confreadGetNextKey(e)){
+		String plist[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
+		char work[WS_SIZE];
+		int n, i;
+		const String key = confreadGetKey(e);
+		const String value = confreadGetValue(e);
+		if(dev->zoneCount >= ZONE_MAX_COUNT)
+			syntax_error(e, configFile, "too many zones");
+		/* Allocate a zone struct */
+		if(!(zm = mallocz(sizeof(zoneMap_t))))
+			MALLOC_ERROR;
+			
+		/* Get the zone number */
+		if(!str2uns(key, &zm->zone_num, 1, ZONE_MAX_NUM))
+			syntax_error(e, configFile,"invalid zone number");
+			
+		/* Get the parameters */
+		n = splitString(value, work, WS_SIZE, plist, ',', 4);
+		if((n != 3) && (n != 4))
+			syntax_error(e, configFile, "3 parameters and an optional rate limit required");
+		for(i = 0; i < n; i++) /* "1 = fire, 24hour, fire" is as good as "1 = fire,24hour,fire" */
+			plist[i] = trimBlanks(plist[i]);
+		if(!(zm->zone_name = strdup(plist[0])))
+			MALLOC_ERROR;
+		if(!(zm->zone_type = strdup(plist[1])))
+			MALLOC_ERROR;
+		if(!(zm->alarm_type = strdup(plist[2])))
+			MALLOC_ERROR;
+			
+		/* Hash the zone name */
+		zm->zone_name_hash = confreadHash(zm->zone_name);
+
+		/* Events from 24 hour zones are never held back */
+		zm->alarmClass = !strcmp(zm->zone_type, "24hour");
+
+		/* Optional rate limit */
+		if(n == 4)
+			parseRateLimit(e, plist[3], zm);
+		
+		/* Insert the entry into the zone list */
+		if(!dev->zoneMapHead)
+			dev->zoneMapHead = dev->zoneMapTail = zm;
+		else{
+			zm->prev = dev->zoneMapTail;
+			dev->zoneMapTail->next = zm;
+			dev->zoneMapTail = zm;
+		}
+		zoneIndexAdd(dev, zm);
+		dev->zoneCount++;
+	}
+}
+
+/*
+* Build a device's expander map from a config section
+*/
+
+static void buildExpMap(adDevicePtr_t dev, const String section)
+{
+	KeyEntryPtr_t e;
+	zoneMapPtr_t zm;
+
+	for(e =  confreadGetFirstKeyBySection(configEntry, section); e; e = confreadGetNextKey(e)){
+		expMapPtr_t emp;
+		const String keyString = confreadGetKey(e);
+		const String value = confreadGetValue(e);
+		String zone = value;
+		String plist[3] = {NULL, NULL, NULL};
+		String vlist[3] = {NULL, NULL, NULL};
+		char work[WS_SIZE], vwork[WS_SIZE];
+		unsigned expaddr = 0, expchannel = 0;
+		int n;
+
+		/* Check the key and zone strings */
+		if(!(keyString) || (!value))
+			syntax_error(e, configFile, "key or zone missing");
+
+		/* Split off an optional rate limit */
+		if((n = splitString(value, vwork, WS_SIZE, vlist, ',', 1)))
+			zone = vlist[0];
+
+
+		/* Split the address and channel */
+		if(2 != splitString(keyString, work, WS_SIZE, plist, ',', 2))
+			syntax_error(e, configFile, "left hand side needs 2 numbers separated by a comma");
+
+		/* Convert and check address */
+		if(!str2uns(plist[0], &expaddr, 1, EXP_MAX_ADDR))
+			syntax_error(e, configFile,"address is limited from 1 - 99");
+
+
+		/* Convert and check channel */
+		if(!str2uns(plist[1], &expchannel, 1, EXP_MAX_CHANNEL))
+			syntax_error(e, configFile,"channel is limited from 1 - 99");
+			
+
+		/* debug(DEBUG_ACTION, "Address: %u, channel: %u, zone: %s", expaddr, expchannel, zone); */
+		
+		/* Look up zone to ensure it is defined */
+		
+		if(!(zm = zoneLookup(dev, zone)))
+			syntax_error(e, configFile, "Zone must be defined in the device's zone map section");
+
+		/* A rate limit here applies to the zone */
+		if(n)
+			parseRateLimit(e, vlist[1], zm);
+
+		/* Get memory for entry */
+		if(!(emp = mallocz(sizeof(expMap_t))))
+			MALLOC_ERROR;
+
+		/* Initialize entry */
+		emp->zone_entry = zm;
+		emp->addr = expaddr;
+		emp->channel = expchannel;
+		if(!(emp->zone = strdup(zone)))
+			MALLOC_ERROR;
+
+		/* Insert into list */
+		if(!dev->expMapHead){
+			dev->expMapHead = dev->expMapTail = emp;
+		}
+		else{
+			dev->expMapTail->next = emp;
+			emp->prev = dev->expMapTail;
+			dev->expMapTail = emp;
+		}
+
+		/* Index by address and channel. Each address in use gets a table of channels. */
+		if(!dev->expIndex[expaddr]){
+			if(!(dev->expIndex[expaddr] = mallocz((EXP_MAX_CHANNEL + 1) * sizeof(expMapPtr_t))))
+				MALLOC_ERROR;
+		}
+		if(!dev->expIndex[expaddr][expchannel]) /* The first mapping wins */
+			dev->expIndex[expaddr][expchannel] = emp;
+	}
+}
+
+/*
+* Build the wireless sensor map for a device
+*/
+
+static void buildRfxMap(adDevicePtr_t dev, const String section)
+{
+	KeyEntryPtr_t e;
+	zoneMapPtr_t zm;
+
+	for(e =  confreadGetFirstKeyBySection(configEntry, section); e; e = confreadGetNextKey(e)){
+		rfxSensorPtr_t rs;
+		const String keyString = confreadGetKey(e);
+		const String zone = confreadGetValue(e);
+		String plist[3] = {NULL, NULL, NULL};
+		char work[WS_SIZE];
+		unsigned long serial = 0;
+		unsigned loop = 0, h;
+		char *end;
+
+		/* Check the key and zone strings */
+		if(!(keyString) || (!zone))
+			syntax_error(e, configFile, "key or zone missing");
+
+		/* Split the serial number and loop */
+		if(2 != splitString(keyString, work, WS_SIZE, plist, ',', 2))
+			syntax_error(e, configFile, "left hand side needs a serial number and a loop separated by a comma");
+
+		/* Convert and check the serial number, it is decimal even with leading zeros */
+		serial = strtoul(plist[0], &end, 10);
+		if((end == plist[0]) || (*end) || (serial > RFX_MAX_SERIAL))
+			syntax_error(e, configFile, "serial number is limited to 7 digits");
+
+		/* Convert and check loop */
+		if(!str2uns(plist[1], &loop, 1, RFX_LOOPS))
+			syntax_error(e, configFile, "loop is limited from 1 - 4");
+
+		/* Look up zone to ensure it is defined */
+		if(!(zm = zoneLookup(dev, zone)))
+			syntax_error(e, configFile, "Zone must be defined in the device's zone map section");
+
+		/* Add the sensor to the hash table if it isn't there yet */
+		if(!(rs = rfxLookup(dev, serial))){
+			if(!(rs = mallocz(sizeof(rfxSensor_t))))
+				MALLOC_ERROR;
+			rs->serial = serial;
+			h = rfxHashIndex(serial);
+			rs->next = dev->rfxHash[h];
+			dev->rfxHash[h] = rs;
+		}
+		rs->loop_zone[loop - 1] = zm;
+	}
+}
+
+/*
+* Build the relay name map for a device
+*/
+
+static void buildRelMap(adDevicePtr_t dev, const String section)
+{
+	KeyEntryPtr_t e;
+
+	for(e =  confreadGetFirstKeyBySection(configEntry, section); e; e = confreadGetNextKey(e)){
+		const String keyString = confreadGetKey(e);
+		const String name = confreadGetValue(e);
+		String plist[3] = {NULL, NULL, NULL};
+		char work[WS_SIZE];
+		unsigned addr = 0, channel = 0;
+
+		/* Check the key and name strings */
+		if(!(keyString) || (!name))
+			syntax_error(e, configFile, "key or relay name missing");
+
+		/* Split the address and channel */
+		if(2 != splitString(keyString, work, WS_SIZE, plist, ',', 2))
+			syntax_error(e, configFile, "left hand side needs 2 numbers separated by a comma");
+
+		/* Convert and check address */
+		if(!str2uns(plist[0], &addr, 0, REL_ADDRS - 1))
+			syntax_error(e, configFile,"address is limited from 0 - 31");
+
+		/* Convert and check channel */
+		if(!str2uns(plist[1], &channel, 1, REL_CHANNELS))
+			syntax_error(e, configFile,"channel is limited from 1 - 4");
+
+		if(!(dev->relays[addr][channel - 1].name = strdup(name)))
+			MALLOC_ERROR;
+	}
+}
+
+/*
+* Add a device to the device table
+*/
+
+static adDevicePtr_t addDevice(const String port, const String iID, const String zoneMapSection)
+{
+	adDevicePtr_t dev;
+	unsigned addr, channel;
+
+	if(deviceCount >= MAX_DEVICES)
+		fatal("Too many devices, the limit is %d", MAX_DEVICES);
+	if(deviceLookup(iID))
+		fatal("Instance ID %s is used by more than one device", iID);
+
+	if(!(dev = mallocz(sizeof(adDevice_t))))
+		MALLOC_ERROR;
+
+	dev->index = deviceCount;
+	dev->nodeWatch = -1;
+	dev->coalesceFD = -1;
+	dev->requestFD = -1;
+	dev->gateStatSent = GATESTAT_NONE;
+	for(addr = 0; addr < REL_ADDRS; addr++){
+		for(channel = 0; channel < REL_CHANNELS; channel++)
+			dev->relays[addr][channel].state = REL_UNKNOWN;
+	}
+	if(!(dev->kpCache = keypad_cache_new(dupWindow * 1000)))
+		MALLOC_ERROR;
+	confreadStringCopy(dev->comPort, port, WS_SIZE);
+	confreadStringCopy(dev->instanceID, iID, WS_SIZE);
+	buildZoneMap(dev, zoneMapSection);
+
+	devices[deviceCount++] = dev;
+	return dev;
+}
+
+
 /*
 * main
 */
@@ -861,8 +2656,9 @@ int main(int argc, char *argv[])
 	int longindex;
 	int optchar;
 	String p;
-	KeyEntryPtr_t e;
-	zoneMapPtr_t zm;
+	SectionEntryPtr_t se;
+	adDevicePtr_t dev;
+	unsigned i, j;
 
 	/* Set the program name */
 	progName=argv[0];
@@ -891,6 +2687,12 @@ int main(int argc, char *argv[])
 		
 
 		
+			/* Was it a capture file path ? */
+			case 'C':
+				confreadStringCopy(captureFile, optarg, WS_SIZE - 1);
+				debug(DEBUG_ACTION,"New capture file path is: %s", captureFile);
+				break;
+
 			/* Was it a debug level set? */
 			case 'd':
 
@@ -944,6 +2746,19 @@ int main(int argc, char *argv[])
 				configOverride |= CO_COM_PORT;
 				break;
 
+			/* Was it a replay file path ? */
+			case 'R':
+				confreadStringCopy(replayFile, optarg, WS_SIZE - 1);
+				debug(DEBUG_ACTION,"New replay file path is: %s", replayFile);
+				break;
+
+			/* Was it a replay speed ? */
+			case 'x':
+				replaySpeed = atof(optarg);
+				if(replaySpeed < 0)
+					fatal("Invalid replay speed");
+				break;
+
 			/* Was it an instance ID ? */
 			case 's':
 				confreadStringCopy(instanceID, optarg, WS_SIZE);
@@ -1015,111 +2830,100 @@ int main(int argc, char *argv[])
 		}	
 	}
 
-	/* Build Zone Map */
-	
-	if(!(e = confreadGetFirstKeyBySection(configEntry, "zone-map")))
-		fatal("A valid zone-map section and at least one entry must be defined in the config file");
-	for(; e; e = confreadGetNextKey(e)){
-		String plist[3];
-		const String key = confreadGetKey(e);
-		const String value = confreadGetValue(e);
-		/* Allocate a zone struct */
-		if(!(zm = mallocz(sizeof(zoneMap_t))))
-			MALLOC_ERROR;
-			
-		/* Get the zone number */
-		if(!str2uns(key, &zm->zone_num, 1, 99))
-			syntax_error(e, configFile,"invalid zone number");
-			
-		/* Get the parameters */
-		if(3 != splitString(value, plist, ',', 3))
-			syntax_error(e, configFile, "3 parameters required");
-		if(!(zm->zone_name = strdup(plist[0])))
-			MALLOC_ERROR;
-		if(!(zm->zone_type = strdup(plist[1])))
-			MALLOC_ERROR;
-		if(!(zm->alarm_type = strdup(plist[2])))
-			MALLOC_ERROR;
-			
-		/* Hash the zone name */
-		zm->zone_name_hash = confreadHash(zm->zone_name);
-		
-			
-		/* Free the split string */
-		free(plist[0]);
-		
-		/* Insert the entry into the zone list */
-		if(!zoneMapHead)
-			zoneMapHead = zoneMapTail = zm;
-		else{
-			zm->prev = zoneMapTail;
-			zoneMapTail->next = zm;
-			zoneMapTail = zm;
-		}
-		zoneCount++;
+	/* Duplicate keypad message window */
+	if((p = confreadValueBySectKey(configEntry, "general", "dup-window"))){
+		if(!str2uns(p, &dupWindow, 0, 3600))
+			fatal("Invalid dup-window: %s", p);
 	}
 
-	/* EXP zone mapping */
-
-	for(e =  confreadGetFirstKeyBySection(configEntry, "exp-map"); e; e = confreadGetNextKey(e)){
-		expMapPtr_t emp;
-		const String keyString = confreadGetKey(e);
-		const String zone = confreadGetValue(e);
-		String plist[3];
-		unsigned expaddr, expchannel;
-
-		/* Check the key and zone strings */
-		if(!(keyString) || (!zone))
-			syntax_error(e, configFile, "key or zone missing");
+	/* Request coalescing window */
+	if((p = confreadValueBySectKey(configEntry, "general", "request-window"))){
+		if(!str2uns(p, &requestWindow, 0, 10000))
+			fatal("Invalid request-window: %s", p);
+	}
 
+	/* Serial ingestion thread */
+	if((p = confreadValueBySectKey(configEntry, "general", "serial-thread"))){
+		if(!str2uns(p, &serialThread, 0, 1))
+			fatal("Invalid serial-thread: %s", p);
+	}
 
-		/* Split the address and channel */
-		plist[0] = NULL;
-		if(2 != splitString(keyString, plist, ',', 2))
-			syntax_error(e, configFile, "left hand side needs 2 numbers separated by a comma");
+	/* Gateway status heartbeat */
+	if((p = confreadValueBySectKey(configEntry, "general", "gatestat-heartbeat"))){
+		if(!str2uns(p, &gateStatHeartbeat, 0, 86400))
+			fatal("Invalid gatestat-heartbeat: %s", p);
+	}
 
-		/* Convert and check address */
-		if(!str2uns(plist[0], &expaddr, 1, 99))
-			syntax_error(e, configFile,"address is limited from 1 - 99");
+	/* Zone transition coalescing window */
+	if((p = confreadValueBySectKey(configEntry, "general", "coalesce-window"))){
+		if(!str2uns(p, &coalesceWindow, 0, 10000))
+			fatal("Invalid coalesce-window: %s", p);
+	}
 
+	/* Build the device list */
+
+	for(se = confreadGetFirstSection(configEntry); se; se = confreadGetNextSection(se)){
+		String devPort, devID;
+		const String section = confreadGetSection(se);
+
+		if((!section) || strcmp(section, "device"))
+			continue;
+
+		if(!(devPort = confreadValueBySectEntKey(se, "com-port")))
+			fatal("Device section on line %u of %s has no com-port", confreadSectionLineNum(se), configFile);
+		if(!(devID = confreadValueBySectEntKey(se, "instance-id")))
+			fatal("Device section on line %u of %s has no instance-id", confreadSectionLineNum(se), configFile);
+		if(!(p = confreadValueBySectEntKey(se, "zone-map")))
+			p = DEF_ZONE_MAP;
+		dev = addDevice(devPort, devID, p);
+		if(!(p = confreadValueBySectEntKey(se, "exp-map")))
+			p = DEF_EXP_MAP;
+		buildExpMap(dev, p);
+		if(!(p = confreadValueBySectEntKey(se, "rfx-map")))
+			p = DEF_RFX_MAP;
+		buildRfxMap(dev, p);
+		if(!(p = confreadValueBySectEntKey(se, "rel-map")))
+			p = DEF_REL_MAP;
+		buildRelMap(dev, p);
+	}
 
-		/* Convert and check channel */
-		if(!str2uns(plist[1], &expchannel, 1, 99))
-			syntax_error(e, configFile,"channel is limited from 1 - 99");
-			
+	/* Without device sections, the general section describes a single device */
+	if(!deviceCount){
+		dev = addDevice(comPort, instanceID, DEF_ZONE_MAP);
+		buildExpMap(dev, DEF_EXP_MAP);
+		buildRfxMap(dev, DEF_RFX_MAP);
+		buildRelMap(dev, DEF_REL_MAP);
+	}
+	else if(configOverride & (CO_COM_PORT | CO_INSTANCE_ID)){
+		/* Command line overrides apply to the first device */
+		if(configOverride & CO_COM_PORT)
+			confreadStringCopy(devices[0]->comPort, comPort, WS_SIZE);
+		if(configOverride & CO_INSTANCE_ID)
+			confreadStringCopy(devices[0]->instanceID, instanceID, WS_SIZE);
+	}
 
-		/* debug(DEBUG_ACTION, "Address: %u, channel: %u, zone: %s", expaddr, expchannel, zone); */
-		
-		/* Look up zone to ensure it is defined */
-		
-		if(!(zm = zoneLookup(zone)))
-			syntax_error(e, configFile, "Zone must be defined in zone-map section");
-		
+	/* A replay runs in the foreground, and only feeds the first device under an instance ID of its own */
+	if(replayFile[0]){
+		char id[WS_SIZE];
 
-		/* Get memory for entry */
-		if(!(emp = mallocz(sizeof(expMap_t))))
-			MALLOC_ERROR;
+		noBackground = TRUE;
+		deviceCount = 1;
+		snprintf(id, sizeof(id), "%.*s-replay", WS_SIZE - 8, devices[0]->instanceID);
+		confreadStringCopy(devices[0]->instanceID, id, WS_SIZE);
+	}
 
-		/* Initialize entry */
-		emp->zone_entry = zm;
-		emp->addr = expaddr;
-		emp->channel = expchannel;
-		if(!(emp->zone = strdup(zone)))
-			MALLOC_ERROR;
+	/* Open the capture files */
+	if(captureFile[0]){
+		for(i = 0; i < deviceCount; i++){
+			char path[WS_SIZE * 2];
 
-		/* Insert into list */
-		if(!expMapHead){
-			expMapHead = expMapTail = emp;
-		}
-		else{
-			expMapTail->next = emp;
-			emp->prev = expMapTail;
-			expMapTail = emp;
+			if(deviceCount > 1)
+				snprintf(path, sizeof(path), "%s.%s", captureFile, devices[i]->instanceID);
+			else
+				confreadStringCopy(path, captureFile, sizeof(path));
+			if(!(devices[i]->capture = capture_open_write(path)))
+				fatal("Could not open capture file: %s", path);
 		}
-
-		/* Free parameter string */
-		if(plist[0])
-			free(plist[0]);
 	}
 
 
@@ -1127,14 +2931,18 @@ int main(int argc, char *argv[])
 	if(debugLvl >= 5)
 		xPL_setDebugging(TRUE);
 
- 	/* Make sure we are not already running (.pid file check). */
+	/* Make sure we are not already running (.pid file check). */
 	if(pid_read(pidFile) != -1) {
 		fatal("%s is already running", progName);
 	}
 
-	/* Check to see the serial device exists before we fork */
-	if(!serio_check_node(comPort))
-		fatal("Serial device %s does not exist or its permissions are not allowing it to be used.", comPort);
+	if(!replayFile[0]){
+		/* Check to see the serial devices exist before we fork */
+		for(i = 0; i < deviceCount; i++){
+			if(!serio_check_node(devices[i]->comPort))
+				fatal("Serial device %s does not exist or its permissions are not allowing it to be used.", devices[i]->comPort);
+		}
+	}
 
 	/* Fork into the background. */
 
@@ -1206,51 +3014,96 @@ int main(int argc, char *argv[])
 		fatal("Unable to start xPL lib");
 	}
 
-	/* Initialize xplrcs service */
-
-	/* Create a service and set our application version */
-	xplService = xPL_createService("hwstar", "xplademco", instanceID);
-  	xPL_setServiceVersion(xplService, VERSION);
+  	/* Install signal traps for proper shutdown */
+ 	signal(SIGTERM, shutdownHandler);
+ 	signal(SIGINT, shutdownHandler);
 
-	/*
-	* Create a status message object
-	*/
+	for(i = 0; i < deviceCount; i++){
+		dev = devices[i];
 
-  	xplStatusMessage = xPL_createBroadcastMessage(xplService, xPL_MESSAGE_STATUS);
-  
-	/*
-	* Create trigger message objects
-	*/
+		/* Create a service for the device and set our application version */
+		dev->service = xPL_createService("hwstar", "xplademco", dev->instanceID);
+		xPL_setServiceVersion(dev->service, VERSION);
 
-	/* security.gateway */
-	if(!(xplEventTriggerMessage = xPL_createBroadcastMessage(xplService, xPL_MESSAGE_TRIGGER)))
-		fatal("Could not initialize security.gateway trigger");
-	xPL_setSchema(xplEventTriggerMessage, "security", "gateway");
+		/*
+		* Create the cached status response objects, they are built when first requested
+		*/
 
-	/* security.zone */
-	if(!(xplZoneTriggerMessage = xPL_createBroadcastMessage(xplService, xPL_MESSAGE_TRIGGER)))
-		fatal("Could not initialize security.zone trigger");
-	xPL_setSchema(xplZoneTriggerMessage, "security", "zone");
+		for(j = 0; j < RC_COUNT; j++){
+			if(!statusBuilders[j])
+				continue;
+			if(!(dev->statusCache[j] = xPL_createBroadcastMessage(dev->service, xPL_MESSAGE_STATUS)))
+				fatal("Could not initialize security.%s response", requestCommandTable.key[j]);
+			xPL_setSchema(dev->statusCache[j], "security", (String) requestCommandTable.key[j]);
+			statusChanged(dev, j);
+		}
+  
+		/*
+		* Create trigger message objects
+		*/
 
+		/* security.gateway */
+		if(!(dev->eventTriggerMessage = xPL_createBroadcastMessage(dev->service, xPL_MESSAGE_TRIGGER)))
+			fatal("Could not initialize security.gateway trigger");
+		xPL_setSchema(dev->eventTriggerMessage, "security", "gateway");
+
+		/* security.zone */
+		if(!(dev->zoneTriggerMessage = xPL_createBroadcastMessage(dev->service, xPL_MESSAGE_TRIGGER)))
+			fatal("Could not initialize security.zone trigger");
+		xPL_setSchema(dev->zoneTriggerMessage, "security", "zone");
+
+		/* security.relay */
+		if(!(dev->relayTriggerMessage = xPL_createBroadcastMessage(dev->service, xPL_MESSAGE_TRIGGER)))
+			fatal("Could not initialize security.relay trigger");
+		xPL_setSchema(dev->relayTriggerMessage, "security", "relay");
+
+		/* security.gatestat, pushed when the panel state changes */
+		if(!(dev->gateStatMessage = xPL_createBroadcastMessage(dev->service, xPL_MESSAGE_STATUS)))
+			fatal("Could not initialize security.gatestat status");
+		xPL_setSchema(dev->gateStatMessage, "security", "gatestat");
+
+		/* Outbound event queue */
+		if(!(dev->eventq = eventq_new()))
+			fatal("Could not create the event queue");
+		if(!xPL_addIODevice(eventHandler, dev->index, eventq_fd(dev->eventq), TRUE, FALSE, FALSE))
+			fatal("Could not register event queue fd with xPL");
+
+		/* Request coalescing timer */
+		if(requestWindow){
+			if((dev->requestFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+				fatal_with_reason(errno, "Could not create request window timer");
+			if(!xPL_addIODevice(requestHandler, dev->index, dev->requestFD, TRUE, FALSE, FALSE))
+				fatal("Could not register request window timer fd with xPL");
+		}
 
-  	/* Install signal traps for proper shutdown */
- 	signal(SIGTERM, shutdownHandler);
- 	signal(SIGINT, shutdownHandler);
+		/* Zone transition coalescing timer */
+		if(coalesceWindow){
+			if((dev->coalesceFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+				fatal_with_reason(errno, "Could not create coalescing timer");
+			if(!xPL_addIODevice(coalesceHandler, dev->index, dev->coalesceFD, TRUE, FALSE, FALSE))
+				fatal("Could not register coalescing timer fd with xPL");
+		}
 
-	/* Initialize the COM port */
-	
-	if(!(serioStuff = serio_open(comPort, COM_BAUD_RATE)))
-		fatal("Could not open com port: %s", comPort);
+		/* The replay supplies its own data */
+		if(replayFile[0])
+			continue;
 
+		/* Initialize the COM port, flush any partial commands, and ask xPL to monitor it */
+		if(!serialOpen(dev, TRUE))
+			fatal("Could not open com port: %s", dev->comPort);
+	}
 
-	/* Flush any partial commands */
-	serio_printf(serioStuff, "\r");
-	usleep(100000);
-	serio_flush_input(serioStuff);
+	/* Do the replay, then shut down. The service stays disabled so nothing goes out on the network. */
+	if(replayFile[0]){
+		doReplay(devices[0]);
+		shutdownHandler(0);
+	}
 
-	/* Ask xPL to monitor our serial device */
-	if(xPL_addIODevice(serioHandler, 1234, serio_fd(serioStuff), TRUE, FALSE, FALSE) == FALSE)
-		fatal("Could not register serial I/O fd with xPL");
+	/* Watch for lost com port nodes to reappear */
+	if((nodeWatchFD = nodewatch_open()) >= 0){
+		if(!xPL_addIODevice(nodeWatchHandler, 0, nodeWatchFD, TRUE, FALSE, FALSE))
+			fatal("Could not register node watch fd with xPL");
+	}
 
 	/* Add 1 second tick service */
 	xPL_addTimeoutHandler(tickHandler, 1, NULL);
@@ -1259,8 +3112,9 @@ int main(int argc, char *argv[])
   	xPL_addMessageListener(xPLListener, NULL);
 
 
- 	/* Enable the service */
-  	xPL_setServiceEnabled(xplService, TRUE);
+ 	/* Enable the services */
+	for(i = 0; i < deviceCount; i++)
+		xPL_setServiceEnabled(devices[i]->service, TRUE);
 
 	/* Update pid file */
 	if(pid_write(pidFile, getpid()) != 0) {
@@ -1269,6 +3123,8 @@ int main(int argc, char *argv[])
 
 
 
+	/* Startup is done, nothing should be allocated while handling events from here on */
+	ALLOCHECK_ARM();
 
  	/** Main Loop **/
 